@@ -5,6 +5,8 @@
                      processing and history features.
 */
 
+#define _GNU_SOURCE
+
 #include<stdio.h>
 #include<stdlib.h>
 #include<stdarg.h>
@@ -15,6 +17,25 @@
 #include<signal.h>
 #include<errno.h>
 #include<ctype.h>
+#include<fcntl.h>
+#include<sys/syscall.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<pthread.h>
+#include<time.h>
+#include<poll.h>
+#include<sys/sendfile.h>
+#include<sys/epoll.h>
+#include<sys/uio.h>
+#include<sys/timerfd.h>
+#include<stdint.h>
+#include<sched.h>
+#include<sys/resource.h>
+#include<sys/eventfd.h>
+#include<semaphore.h>
+#include<spawn.h>
+#include<limits.h>
+#include<dirent.h>
 
 /* 
 	Output an error message and fail.
@@ -43,6 +64,138 @@ static void shfault(char*fmt, ...)
 	va_end(ap);
 }
 
+/*
+	A growable, NUL-terminated string.
+*/
+
+typedef struct Strbuf_def
+{
+        char*s;
+        size_t len,size;
+} Strbuf;
+
+static void sb_grow(Strbuf*sb,size_t n)
+{
+        if(sb->len+n+1>sb->size)
+        {
+                size_t size=sb->size?sb->size:64;
+
+                while(size<sb->len+n+1)
+                        size*=2;
+
+                sb->s=realloc(sb->s,size);
+                if(!sb->s)
+                        shfail("realloc");
+
+                sb->size=size;
+        }
+}
+
+static void sb_putn(Strbuf*sb,const char*p,size_t n)
+{
+        sb_grow(sb,n);
+        memcpy(sb->s+sb->len,p,n);
+        sb->len+=n;
+        sb->s[sb->len]='\0';
+}
+
+static void sb_putc(Strbuf*sb,int c)
+{
+        sb_grow(sb,1);
+        sb->s[sb->len++]=c;
+        sb->s[sb->len]='\0';
+}
+
+/*
+	Hand the string over to the caller and leave sb empty.
+
+	Postcondition: the result is malloc()ed and never NULL
+*/
+
+static char*sb_take(Strbuf*sb)
+{
+        char*s;
+
+        sb_grow(sb,0);
+        sb->s[sb->len]='\0';
+        s=sb->s;
+        memset(sb,0,sizeof *sb);
+
+        return s;
+}
+
+/*
+	A growable, NULL-terminated vector of strings, as for execvp().
+*/
+
+typedef struct Vec_def
+{
+        char**v;
+        size_t n,size;
+} Vec;
+
+static void vec_push(Vec*vp,char*s)
+{
+        if(vp->n+2>vp->size)
+        {
+                vp->size=vp->size?vp->size*2:8;
+                vp->v=realloc(vp->v,vp->size*sizeof *vp->v);
+                if(!vp->v)
+                        shfail("realloc");
+        }
+
+        vp->v[vp->n++]=s;
+        vp->v[vp->n]=NULL;
+}
+
+static void vec_free(Vec*vp)
+{
+        register size_t i;
+
+        for(i=0;i<vp->n;i++)
+                free(vp->v[i]);
+
+        free(vp->v);
+        memset(vp,0,sizeof *vp);
+}
+
+/*
+	Exit status of the last foreground command, as seen by $?.
+*/
+
+static int last_status=0;
+
+/*
+	Set in a forked child that runs shell code: a subshell, a
+	background compound command or a builtin.
+*/
+
+static int in_child;
+
+/*
+	Set in the child of a timeout job, whose time limit the shell
+	keeps; see builtin_timeout().
+*/
+
+static int job_timed;
+
+/*
+	Set in a forked child whose only work is the simple command it
+	runs, so that a prefix like with can change the process itself
+	and then exec the rest of the command.
+*/
+
+static int command_child;
+
+/*
+	Set in the child of a background pipeline to the cache domain the
+	shell placed it in; see run_pipeline().
+*/
+
+static int pipe_domain=-1;
+
+#define TIMEOUT_GRACE 5
+
 
 /*
 	Print program exit status information.
@@ -92,57 +245,137 @@ static void wait_handler(int stat_loc)
 /* 
 	Output a message to the terminal.
 
-	Precondition: line!=NULL
+	Precondition: argv!=NULL&&*argv!=NULL
 */
    
 
-static void builtin_echo(char*line)
+static int builtin_echo(char**argv)
 {
-        register char*p=strpbrk(line," \t");
+        register char**pp;
 
-        if(p&&*++p)
-                puts(p);
-        else
-                putchar('\n');
+        for(pp=argv+1;*pp;pp++)
+        {
+                fputs(*pp,stdout);
+
+                if(pp[1])
+                        putchar(' ');
+        }
+
+        putchar('\n');
+
+        return 0;
 }
 
 /* 
-	Exit the shell. 
+	Exit the shell, with the status of the last command unless
+	one is given.
 
-	Precondition: line!=NULL&&strlen(line)>3
+	Precondition: argv!=NULL&&*argv!=NULL
 */
 
-static void builtin_exit(char*line)
+static int builtin_exit(char**argv)
 {
-        char*p=line+4;
+        int status=argv[1]?atoi(argv[1]):last_status;
 
-        if(!*p)
-                exit(EXIT_SUCCESS);
+        /* See spawn(): a child must not rewind a shared input. */
+        if(in_child)
+        {
+                fflush(stdout);
+                _exit(status);
+        }
+
+        exit(status);
 }
 
 /* 
 	Enumerate built-in shell commands.
 */
 
-static void builtin_help(char*help)
+static int builtin_help(char**argv)
 {
         puts("\nsupersh by Derek Callaway");
         puts("^^^^^^^^^^^^^^^^^^^^^^^^^");
+        puts(":, true - do nothing, successfully");
+        puts("[, test - evaluate a conditional expression");
+        puts("break   - leave a for, while or until loop");
+        puts("continue - start the next iteration of a loop");
+        puts("copy    - copy a file, in the kernel where it can");
         puts("echo    - output messages to terminal standard output");
         puts("exit    - terminate shell process");
+        puts("false   - do nothing, unsuccessfully");
         puts("help    - print this message");
         puts("history - view previously executed commands");
         puts("jobs    - list background commands");
-        puts("set     - assign environment variable values\n");
+        puts("meter   - pass data through, reporting its throughput and stalls");
+        puts("printf  - output formatted data");
+        puts("read    - assign a line of standard input to variables");
+        puts("set     - assign environment variable values");
+        puts("tee     - copy standard input to standard output and files");
+        puts("timeout - run a command with a time limit");
+        puts("wait    - wait for background commands to finish");
+        puts("with    - run a command with CPU, priority and limit settings\n");
+
+        return 0;
 }
 
+/*
+	Kinds of I/O redirection; see lex_redir().  For a here-document
+	word is the body, expanded (REDIR_HERE) or taken as it is
+	(REDIR_HERELIT); for a here-string it is the word to expand.
+*/
+
+enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_HERE, REDIR_HERELIT,
+       REDIR_HERESTR };
+
+typedef struct Redir_def
+{
+        int fd;
+        int type;
+        char*word;
+        struct Redir_def*next;
+} Redir;
+
+typedef int(*Builtin)(char**);
+
+/*
+	A parsed command.  IN_SIMPLE has words (unexpanded, see expand()),
+	leading NAME=value assignments and redirections; IN_LIST runs the
+	commands chained from body.  IN_IF runs body or elsepart on the
+	status of cond, IN_WHILE repeats body while (or until) cond
+	succeeds and IN_FOR runs body once per word of cmdvec with name
+	set to it.  IN_CASE matches the expanded name against the arms
+	chained from body, each an IN_LIST with its patterns in cmdvec;
+	unless a pattern needs expanding (dynamic), matcher holds them
+	all compiled together.  IN_PIPE connects the stages chained from
+	body by pipes.  Within a chain, op says how a command depends on
+	the status left by the one before it.
+
+	The tree is built once; loops run it again without re-parsing.
+*/
+
+enum { IN_SIMPLE, IN_LIST, IN_IF, IN_WHILE, IN_FOR, IN_CASE, IN_PIPE };
+enum { OP_SEQ, OP_AND, OP_OR };
+
 typedef struct Input_def
 {
         char**cmdvec;
-        void(*internal)(char*);
+        char**assigns;
+        char*cmdbuf;
+        char*name;
+        Redir*redirs;
+        Builtin internal;
+        struct Input_def*cond;
+        struct Input_def*body;
+        struct Input_def*elsepart;
+        struct Input_def*link;
         struct Input_def*next;
+        struct Glob_def*matcher;
+        unsigned int kind:3;
+        unsigned int op:2;
         unsigned int background:1;
 	unsigned int historical:1;
+        unsigned int until:1;
+        unsigned int dynamic:1;
 } Input;
 
 static Input*histlist=NULL;
@@ -151,420 +384,9227 @@ static Input*histlist=NULL;
 	Show previously executed commands. 
 */
 
-static void builtin_history(char*line)
+static int builtin_history(char**argv)
 {
         register unsigned int cnt=0;
         Input*hp;
 
         for(hp=histlist;hp;hp=hp->next)
-                printf("%u %s %s",++cnt,hp->cmdvec[0],hp->background?"&\n":"\n");
+                printf("%u %s\n",++cnt,hp->cmdbuf);
+
+        return 0;
 }
 
-typedef struct Job_def
+static double now_seconds(void)
 {
-        pid_t pid;
-        char*cmdbuf;
-        struct Job_def*next;
-} Job;
+        struct timespec ts;
 
-static Job*joblist=NULL;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
 
-/* 
-	List currently executing background commands.
+        return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/*
+	Format a count of bytes with a binary unit.
 */
 
-static void builtin_jobs(char*line)
+static void format_bytes(char*buf,size_t size,double bytes)
 {
-        register unsigned int cnt=0;
-        Job*jp;
+        static const char*units[]={ "B","KiB","MiB","GiB","TiB" };
+        int u=0;
 
-        for(jp=joblist;jp;jp=jp->next)
-                printf("Running\tpid: %d job: %u argv: %s\n",(int)jp->pid,++cnt,jp->cmdbuf);
+        while(bytes>=1024&&u<4)
+        {
+                bytes/=1024;
+                u++;
+        }
+
+        snprintf(buf,size,"%.1f %s",bytes,units[u]);
 }
 
-extern char**environ;
+/*
+	Format a rate of bytes over secs seconds with a binary unit.
+*/
 
-/* 
-	Display or modify environment variables. 
-  
-	Precondition: line!=NULL&&strlen(line)>2
-	Postcondition: If a variable name or binding was specified,
-		       then an element of environ was added or modified.
+static void format_rate(char*buf,size_t size,double bytes,double secs)
+{
+        format_bytes(buf,size,secs>0?bytes/secs:0);
+        strncat(buf,"/s",size-strlen(buf)-1);
+}
+
+/*
+	A bounded buffer of a job's output.  The memfd behind it is
+	mapped twice, back to back, so the size bytes from any offset are
+	contiguous: reads land straight in the buffer and it is dumped in
+	one piece, however it has wrapped.  Once full, new output
+	overwrites the oldest.
 */
 
-static void builtin_set(char*line)
+typedef struct
 {
-        char*p=line+3;
+        char*base;
+        size_t size,head,len;
+} Ring;
 
-	p+=strspn(p," \t\r\n\v\f");
+static int ring_open(Ring*rp,size_t size)
+{
+        long page=sysconf(_SC_PAGESIZE);
+        char*base;
+        int fd;
 
-        if(!*p)
-	{
-		register char**pp;
+        size=(size+page-1)/page*page;
 
-                for(pp=environ;*pp;pp++)
-                        puts(*pp);
-	}
-        else
-        {
-                char*eq_flag=strchr(p,'='),*binding;
-               
-		if(eq_flag==p)
-			shfault("syntax error near: '='");
+        if((fd=memfd_create("job-output",MFD_CLOEXEC))<0)
+                return -1;
 
-		binding=malloc(strlen(p)+eq_flag?1:2);
+        base=mmap(NULL,2*size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
 
-                if(!binding)
-                        shfail("malloc");
+        if(ftruncate(fd,size)||base==MAP_FAILED
+           ||mmap(base,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED
+           ||mmap(base+size,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED)
+        {
+                int e=errno;
 
-                /* account for whitespace before equal sign? */
-                strcpy(binding,p);
+                if(base!=MAP_FAILED)
+                        munmap(base,2*size);
 
-                if(!eq_flag)
-                {
-                        char*p2=&binding[strlen(p)];
-                        *p2++='=';
-                        *p2='\0';
-                }
+                close(fd);
+                errno=e;
 
-                if(putenv(binding))
-                        shfail("putenv");
+                return -1;
         }
+
+        close(fd);
+        rp->base=base;
+        rp->size=size;
+        rp->head=rp->len=0;
+
+        return 0;
 }
 
-/*
-	Parse user-provided command line input.
+static void ring_free(Ring*rp)
+{
+        if(rp->base)
+                munmap(rp->base,2*rp->size);
 
- 	Precondition: in!=NULL
-	Postcondition: 
-		if((i=parse_inbuf))
-		{
-			i->next=NULL;
-			i->cmdvec!=NULL;
+        rp->base=NULL;
+}
 
-			if(i->internal)
-				internal==builtin_*;
-			
-			i->cmdvec[*]==&in[0..strlen(in)];
-		}
+/*
+	Read what fd has into the ring, evicting the oldest bytes to make
+	room.
+
+	Postcondition: returns the count read, 0 at end of file, or -1
+		       with errno set (EAGAIN once fd is empty)
 */
-	
 
-static Input*parse_inbuf(char*in)
+static ssize_t ring_read(Ring*rp,int fd)
 {
-	char*cl[BUFSIZ],*amp,*oldp;
-        register char*p=in,**pp=cl;
-        Input*ret=NULL;
-        size_t len;
+        ssize_t n=read(fd,rp->base+(rp->head+rp->len)%rp->size,rp->size);
 
-        ret=calloc(1,sizeof *ret);
-        if(!ret)
-                shfail("calloc");
+        if(n<=0)
+                return n;
 
-        /* The following sequence of if-else statements corresponds to 
-           commands which are internal to the shell. */
-        if(!strncmp(in,"echo",4)&&isspace((int)in[4]))
-                ret->internal=builtin_echo;
-        else if(!strncmp(in,"exit",4)&&isspace((int)in[4]))
-                ret->internal=builtin_exit;
-        else if(!strncmp(in,"help",4)&&isspace((int)in[4]))
-                ret->internal=builtin_help;
-        else if(!strncmp(in,"history",7)&&isspace((int)in[7]))
-                ret->internal=builtin_history;
-        else if(!strncmp(in,"jobs",4)&&isspace((int)in[4]))
-                ret->internal=builtin_jobs;
-        else if(!strncmp(in,"set",3)&&isspace((int)in[3]))
-                ret->internal=builtin_set;
-
-        pp=cl;
-
-        if(ret->internal)
-                *pp++=in;
+        if(rp->len+n>rp->size)
+        {
+                rp->head=(rp->head+rp->len+n-rp->size)%rp->size;
+                rp->len=rp->size;
+        }
         else
-	{
-		/* Deal with history reference, if any. */
-		char*exc=strchr(p,'!');
-
-		if(exc)
-		{
-			unsigned long hr;
+                rp->len+=n;
 
-			p=++exc;
-			p+=strcspn(exc," \t\r\n\v\f");
-			*p='\0';
-
-			hr=strtoul(exc,NULL,10);
-			if(!hr)
-			{
-				perror("strtoul");
-				free(ret);
-				ret=NULL;
-			}
-			else
-			{
-				register unsigned int cnt=0;
-				Input*hp;
+        return n;
+}
 
-				for(hp=histlist;hp;hp=hp->next)
-					if(++cnt==hr)
-						break;
+/*
+	A background command, on joblist while it runs.  A finished job
+	that left captured output moves to donelist, where jobs -o can
+	still show it.
+*/
 
-				if(cnt!=hr)
-				{
-					shfault("!%lu: event not found",hr);
-					return NULL;
-				}
+typedef struct Job_def
+{
+        pid_t pid;
+        unsigned int id;
+        /* With JOB_CAPTURE or JOB_LINES, the read end of the pipe its
+           output and error go down.  JOB_CAPTURE keeps the latest in
+           ring; JOB_LINES (lines) has the shell write it out a line
+           at a time, holding an unfinished one in partial. */
+        int fd;
+        Ring ring;
+        Strbuf partial;
+        unsigned int lines:1;
+        /* A time limit: timer sends SIGTERM when it fires, and SIGKILL
+           grace seconds later; signalled counts those sent.  A job
+           held at gate keeps its limit until it runs. */
+        int timer;
+        double grace,limit;
+        unsigned int signalled:2;
+        int gate;
+        /* For jobs -s: open /proc files, and the CPU time last seen
+           in ticks, at time sampled. */
+        int statfd,iofd;
+        unsigned long long ticks;
+        double sampled;
+        /* Where placement put it, or -1: the CPU pinned to, the cache
+           domain of its pipeline and the NUMA node bound to. */
+        int cpu,domain,node;
+        /* The priorities fg_yield() changed (yielded), to restore. */
+        int nice,ioprio;
+        unsigned int yielded:2;
+        char*cmdbuf;
+        struct Job_def*next;
+} Job;
 
-				memcpy(ret,hp,sizeof *ret);
-				ret->historical=1;
-			}
+static Job*joblist=NULL,*donelist=NULL;
 
-			return ret;
-		}
+#define JOB_DONE_KEEP 16
 
-                do
-                {
-			/* Fill an array appropriate for passing to execvp(). */
-                       	p+=strspn(p," \t\r\n\v\f");
+/*
+	Jobs reap_jobs() found finished, with their exit status, until
+	wait collects them or a new job takes the number; the oldest go
+	beyond JOB_REAPED_KEEP.
+*/
 
-                       	if(!*p)
-                               	break;
+#define JOB_REAPED_KEEP 64
 
-                       	oldp=p;
-                       	p+=strcspn(p," \t\r\n\v\f");
-                        *pp++=oldp;
+typedef struct
+{
+        pid_t pid;
+        unsigned int id;
+        int status;
+} Reaped;
 
-			if(*p)
-                        	*p='\0';
-			else
-				break;
-                } while(*++p);
-	}
+static Reaped reaped[JOB_REAPED_KEEP];
+static unsigned int nreaped;
 
-        *pp=NULL;
+static void reaped_drop(unsigned int i)
+{
+        memmove(reaped+i,reaped+i+1,(--nreaped-i)*sizeof *reaped);
+}
 
-        len=pp-cl;
+/*
+	The event loop: an epoll set of the output pipes and timers of
+	jobs, nwatched in all, serviced whenever the shell would otherwise
+	block, so that a job never stalls on a full pipe or outlives its
+	time.  Each is registered under its Job, tagged with the kind of
+	descriptor in the low bits; the throttle timer and the eventfd of
+	the spawn pool are registered under no Job.  Children inherit the
+	set, so only the process that made it may use it; a child makes
+	its own.
+*/
 
-        ret->cmdvec=malloc((len+1)*sizeof *(ret->cmdvec));
-        if(!ret->cmdvec)
-                shfail("malloc");
+#define EVENT_OUTPUT 0
+#define EVENT_TIMER 1
+#define EVENT_KIND 3ULL
 
-        memcpy(ret->cmdvec,cl,(len+1)*sizeof *(ret->cmdvec));
+static int event_fd=-1;
+static pid_t event_owner;
+static unsigned int nwatched;
 
-        /* Handle a possible background processing operator. */
-        p=cl[len-1];
+static int event_init(void)
+{
+        if(event_fd>=0&&event_owner==getpid())
+                return 0;
 
-        amp=strchr(p,'&');
-        if(amp)
+        if(event_fd>=0)
         {
-                ret->background=1;
-
-                if(amp==p)
-                        ret->cmdvec[len-1]=NULL;
+                close(event_fd);
+                nwatched=0;
         }
-        else
-                amp=&cl[len-1][strlen(cl[len-1])];
 
-        if(amp!=in)
+        if((event_fd=epoll_create1(EPOLL_CLOEXEC))<0)
         {
-                do amp--; while(amp>in&&isspace((int)*amp));
-                *++amp='\0';
+                shfault("epoll: %s",strerror(errno));
+                return -1;
         }
 
-        return ret;
-}
+        event_owner=getpid();
 
-void handler(int signum){}
+        return 0;
+}
 
-int main(void)
+static int event_watch(int fd,Job*jp,int kind)
 {
-        char*inbuf;
-        pid_t pid;
-        Input*input_data,*hptr;
-        unsigned long count_commands=1;
-        register char*p;
+        struct epoll_event ev;
 
-        puts(":-) Welcome to supersh. Type help for help.\n");
+        ev.events=EPOLLIN;
+        ev.data.u64=(uintptr_t)jp|kind;
 
-	signal(SIGINT,SIG_IGN);
-	signal(SIGTERM,SIG_IGN);
-
-        while(1)
+        if(event_init()||epoll_ctl(event_fd,EPOLL_CTL_ADD,fd,&ev))
         {
-		Job*jptr,*jprev=NULL;
-		register unsigned int cnt=0;
+                shfault("epoll: %s",strerror(errno));
+                return -1;
+        }
 
-                printf("[%lu]%c ",count_commands,getuid()?'$':'#');
+        nwatched++;
 
-                inbuf=malloc(BUFSIZ);
-                if(!inbuf)
-                        shfail("malloc");
+        return 0;
+}
 
-                p=inbuf;
+/*
+	Unregister and close a job descriptor.  Removal has to be explicit:
+	a forked child holding a copy would keep it in the set.
+*/
 
-                if(!fgets(p,BUFSIZ,stdin))
-                        exit(EXIT_SUCCESS);
+static void event_close(int fd)
+{
+        epoll_ctl(event_fd,EPOLL_CTL_DEL,fd,NULL);
+        close(fd);
+        nwatched--;
+}
 
-                for(jptr=joblist;jptr;jptr=jptr->next)
-                {
-			int stat_loc=0;
+/*
+	Parse a size in bytes, with an optional k, m, g or t suffix.
 
-                       	cnt++;
+	Postcondition: returns 0, or -1 if p is not a size
+*/
 
-                       	if(waitpid(jptr->pid,&stat_loc,WNOHANG)==jptr->pid)
-			{
-                       		if(WIFEXITED(stat_loc))
-                        	{
-                       			printf("End\tpid: %d job: %u argv: %s exit: %d\n",
-						(int)jptr->pid,cnt,jptr->cmdbuf,WEXITSTATUS(stat_loc));
-
-					if(jptr->next)
-					{
-                                		if(jprev)
-                                        		jprev->next=jptr->next;
-                                        	else
-							joblist=jptr->next;
-
-						free(jptr);
-					}
-					else
-					{
-						free(joblist);
-						joblist=NULL;
-						jptr=joblist;
-						break;
-				 	}
-				}
-
-                         	wait_handler(stat_loc);
-                         	jprev=jptr;
-                	}
-		}
+static int parse_size(char*p,unsigned long long*n)
+{
+        char*end;
+        int shift=0;
 
-                input_data=NULL;
+        *n=strtoull(p,&end,10);
 
-                p+=strspn(p," \t\r\n\v\f");
-                if(!*p)
-                        continue;
+        if(end==p)
+                return -1;
 
-                count_commands++;
+        switch(tolower((unsigned char)*end))
+        {
+                case 't':
+                        shift+=10;
+                        /* fall through */
+                case 'g':
+                        shift+=10;
+                        /* fall through */
+                case 'm':
+                        shift+=10;
+                        /* fall through */
+                case 'k':
+                        shift+=10;
+                        end++;
+        }
 
-                if(!histlist)
-                {
-                        histlist=calloc(1,sizeof *histlist);
-                        if(!histlist)
-                                shfail("malloc");
+        *n<<=shift;
 
-                        hptr=histlist;
-                }
-                else
-                {
-                        register unsigned int cnt=0;
+        return *end?-1:0;
+}
 
-                        hptr=histlist;
+/*
+	Parse JOB_CAPTURE, the number of bytes of output to keep per
+	background job.
 
-                        if(hptr)
-                        {
-                                cnt++;
+	Postcondition: returns 0 if capture is off
+*/
 
-                                while(hptr&&hptr->next)
-                                {
-                                        hptr=hptr->next;
-                                        cnt++;
-                                } 
+static size_t job_capture_size(void)
+{
+        char*p=getenv("JOB_CAPTURE");
+        unsigned long long n;
 
-                                if(cnt>=BUFSIZ)
+        if(!p||!*p||parse_size(p,&n))
+                return 0;
+
+        return n;
+}
+
+/*
+	Set up the output pipe of a job about to start, and its ring if
+	JOB_CAPTURE is set.  *lines says whether JOB_LINES is.  add_job()
+	registers the pipe with the event loop.
+
+	Postcondition: returns 0, or -1 with the pipe left off
+*/
+
+static int job_capture(Ring*rp,int pfd[2],int*lines)
+{
+        size_t size=job_capture_size();
+        char*p=getenv("JOB_LINES");
+
+        *lines=p&&*p;
+
+        if(!size&&!*lines)
+                return -1;
+
+        if(event_init())
+                return -1;
+
+        if(size&&ring_open(rp,size))
+        {
+                shfault("JOB_CAPTURE: %s",strerror(errno));
+                return -1;
+        }
+
+        if(pipe2(pfd,O_CLOEXEC))
+        {
+                shfault("pipe: %s",strerror(errno));
+                ring_free(rp);
+                return -1;
+        }
+
+        fcntl(pfd[0],F_SETFL,O_NONBLOCK);
+
+        return 0;
+}
+
+/*
+	Write out all of iov, across short writes.
+*/
+
+static void writev_all(int fd,struct iovec*iov,int cnt)
+{
+        ssize_t n;
+
+        while(cnt>0)
+        {
+                if((n=writev(fd,iov,cnt))<0)
+                {
+                        if(errno==EINTR)
+                                continue;
+
+                        return;
+                }
+
+                for(;cnt>0&&(size_t)n>=iov->iov_len;iov++,cnt--)
+                        n-=iov->iov_len;
+
+                if(cnt>0)
+                {
+                        iov->iov_base=(char*)iov->iov_base+n;
+                        iov->iov_len-=n;
+                }
+        }
+}
+
+#define JOB_IOV 1024
+#define JOB_LINE_MAX 65536
+
+/*
+	Write out the complete lines in p of a JOB_LINES job, each behind
+	its job number, and keep the rest for later.  All the lines of
+	one read go out in a single writev(), so no line is ever split
+	or interleaved with another job's.  A line still unfinished at
+	end of file (done), or longer than JOB_LINE_MAX, goes out with
+	a newline added.
+*/
+
+static void job_lines(Job*jp,char*p,size_t n,int done)
+{
+        struct iovec iov[JOB_IOV];
+        char prefix[16],*end=p+n,*nl;
+        int k=0,plen=snprintf(prefix,sizeof prefix,"[%u] ",jp->id);
+        size_t held=jp->partial.len;
+
+        fflush(stdout);
+
+        while(p<end&&(nl=memchr(p,'\n',end-p)))
+        {
+                if(k+3>JOB_IOV)
+                {
+                        writev_all(STDOUT_FILENO,iov,k);
+                        k=0;
+                }
+
+                iov[k].iov_base=prefix;
+                iov[k++].iov_len=plen;
+
+                if(held)
+                {
+                        iov[k].iov_base=jp->partial.s;
+                        iov[k++].iov_len=held;
+                        held=0;
+                }
+
+                iov[k].iov_base=p;
+                iov[k++].iov_len=nl+1-p;
+                p=nl+1;
+        }
+
+        writev_all(STDOUT_FILENO,iov,k);
+
+        if(!held)
+                jp->partial.len=0;
+
+        if(p<end)
+                sb_putn(&jp->partial,p,end-p);
+
+        if(jp->partial.len&&(done||jp->partial.len>=JOB_LINE_MAX))
+        {
+                iov[0].iov_base=prefix;
+                iov[0].iov_len=plen;
+                iov[1].iov_base=jp->partial.s;
+                iov[1].iov_len=jp->partial.len;
+                iov[2].iov_base="\n";
+                iov[2].iov_len=1;
+                writev_all(STDOUT_FILENO,iov,3);
+                jp->partial.len=0;
+        }
+}
+
+/*
+	Take in all the output a job has ready, and stop watching its
+	pipe at end of file.  Captured output is read straight into the
+	ring; the mirror mapping keeps what was just read contiguous for
+	job_lines() as well.
+*/
+
+static void job_drain(Job*jp)
+{
+        char buf[JOB_LINE_MAX],*p;
+        ssize_t n;
+
+        if(jp->fd<0)
+                return;
+
+        for(;;)
+        {
+                if(jp->ring.base)
+                {
+                        p=jp->ring.base+(jp->ring.head+jp->ring.len)%jp->ring.size;
+                        n=ring_read(&jp->ring,jp->fd);
+                }
+                else
+                {
+                        p=buf;
+                        n=read(jp->fd,buf,sizeof buf);
+                }
+
+                if(n>0&&jp->lines)
+                        job_lines(jp,p,n,0);
+                else if(n<0&&errno==EINTR)
+                        continue;
+                else if(n<=0)
+                        break;
+        }
+
+        if(n<0&&errno==EAGAIN)
+                return;
+
+        if(jp->lines)
+                job_lines(jp,NULL,0,1);
+
+        event_close(jp->fd);
+        jp->fd=-1;
+}
+
+/*
+	Parse a duration: a number of seconds, or of minutes, hours or
+	days with an m, h or d suffix.
+
+	Postcondition: returns 0, or -1 if p is not a duration
+*/
+
+static int parse_duration(char*p,double*secs)
+{
+        char*end;
+
+        *secs=strtod(p,&end);
+
+        if(end==p||*secs<0)
+                return -1;
+
+        switch(*end)
+        {
+                case 'd':
+                        *secs*=24;
+                        /* fall through */
+                case 'h':
+                        *secs*=60;
+                        /* fall through */
+                case 'm':
+                        *secs*=60;
+                        /* fall through */
+                case 's':
+                        end++;
+        }
+
+        return *end?-1:0;
+}
+
+static int timer_arm(int fd,double secs)
+{
+        struct itimerspec its={{0,0},{0,0}};
+
+        its.it_value.tv_sec=secs;
+        its.it_value.tv_nsec=(secs-(time_t)secs)*1e9;
+
+        /* A zero it_value would disarm it. */
+        if(!its.it_value.tv_sec&&!its.it_value.tv_nsec)
+                its.it_value.tv_nsec=1;
+
+        return timerfd_settime(fd,0,&its,NULL);
+}
+
+/*
+	Put a time limit of secs on a running job.
+*/
+
+static void job_timer(Job*jp,double secs,double grace)
+{
+        jp->grace=grace;
+
+        if((jp->timer=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0
+           ||timer_arm(jp->timer,secs))
+        {
+                shfault("timeout: %s",strerror(errno));
+
+                if(jp->timer>=0)
+                        close(jp->timer);
+
+                jp->timer=-1;
+        }
+        else if(event_watch(jp->timer,jp,EVENT_TIMER))
+        {
+                close(jp->timer);
+                jp->timer=-1;
+        }
+}
+
+/*
+	A job's time is up: send SIGTERM, and arm the timer again for the
+	SIGKILL that follows unless the grace period is 0.
+*/
+
+static void job_expired(Job*jp)
+{
+        uint64_t ticks;
+
+        if(read(jp->timer,&ticks,sizeof ticks)<0)
+                return;
+
+        if(!jp->signalled++)
+        {
+                kill(jp->pid,SIGTERM);
+
+                if(jp->grace>0&&!timer_arm(jp->timer,jp->grace))
+                        return;
+        }
+        else
+                kill(jp->pid,SIGKILL);
+
+        event_close(jp->timer);
+        jp->timer=-1;
+}
+
+/*
+	Throttling of background launches.  JOB_PRESSURE lists thresholds
+	such as cpu=50,memory=10,io=30: the share, in percent, of the last
+	ten seconds in which some task stalled on that resource, as
+	/proc/pressure tells it.  A job launched while one is crossed, or
+	while others are held, is forked but held at its gate, a pipe its
+	child reads a byte from before it runs the command, and shows as
+	Throttled.  throttled counts those held; while there are any,
+	throttle_timer ticks every THROTTLE_INTERVAL milliseconds, and at
+	each tick the pressure is below the thresholds the oldest is let
+	go.
+*/
+
+#define THROTTLE_INTERVAL 250
+#define EVENT_THROTTLE 2
+
+static int throttle_timer=-1;
+static unsigned int throttled;
+
+static int read_file(const char*path,char*buf,size_t size);
+
+/*
+	Whether the pressure on a resource is over its JOB_PRESSURE
+	threshold.  report says whether to complain about a bad one.
+*/
+
+static int pressure_high(int report)
+{
+        char*p=getenv("JOB_PRESSURE"),*end,name[16],path[64],buf[256];
+        double limit;
+
+        while(p&&*p)
+        {
+                size_t n=strcspn(p,"=, ");
+                char*avg;
+
+                if(p[n]!='='||n>=sizeof name||(limit=strtod(p+n+1,&end),end==p+n+1)||(*end&&!strchr(", ",*end)))
+                {
+                        if(report)
+                                shfault("JOB_PRESSURE: %.*s: invalid threshold",(int)strcspn(p,", "),p);
+
+                        p+=strcspn(p,", ");
+                        p+=strspn(p,", ");
+                        continue;
+                }
+
+                memcpy(name,p,n);
+                name[n]='\0';
+                snprintf(path,sizeof path,"/proc/pressure/%s",name);
+                p=end+strspn(end,", ");
+
+                if(read_file(path,buf,sizeof buf)||!(avg=strstr(buf,"some avg10=")))
+                {
+                        if(report)
+                                shfault("JOB_PRESSURE: %s: %s",path,errno?strerror(errno):"unreadable");
+
+                        continue;
+                }
+
+                if(strtod(avg+11,NULL)>limit)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/*
+	Let a throttled job run, or drop its gate if run is 0 because it
+	has gone.  The time limit of a job starts when it is let go.
+*/
+
+static void throttle_release(Job*jp,int run)
+{
+        if(run&&write(jp->gate,"",1)<0)
+                shfault("gate: %s",strerror(errno));
+
+        close(jp->gate);
+        jp->gate=-1;
+
+        if(run&&jp->limit>0)
+                job_timer(jp,jp->limit,jp->grace);
+
+        if(!--throttled&&throttle_timer>=0)
+        {
+                event_close(throttle_timer);
+                throttle_timer=-1;
+        }
+}
+
+/*
+	Hold a job at its gate, starting the timer if it is the first.
+*/
+
+static void throttle_hold(Job*jp)
+{
+        struct itimerspec its;
+
+        throttled++;
+
+        if(throttle_timer>=0)
+                return;
+
+        its.it_value.tv_sec=its.it_interval.tv_sec=THROTTLE_INTERVAL/1000;
+        its.it_value.tv_nsec=its.it_interval.tv_nsec=THROTTLE_INTERVAL%1000*1000000L;
+
+        if((throttle_timer=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0
+           ||timerfd_settime(throttle_timer,0,&its,NULL)||event_watch(throttle_timer,NULL,EVENT_THROTTLE))
+        {
+                /* Without a timer nothing would let it go. */
+                shfault("throttle: %s",strerror(errno));
+
+                if(throttle_timer>=0)
+                        close(throttle_timer);
+
+                throttle_timer=-1;
+                throttle_release(jp,1);
+        }
+}
+
+static void throttle_tick(void)
+{
+        uint64_t ticks;
+        Job*jp;
+
+        if(read(throttle_timer,&ticks,sizeof ticks)<0||pressure_high(0))
+                return;
+
+        /* joblist is in launch order. */
+        for(jp=joblist;jp;jp=jp->next)
+                if(jp->gate>=0)
+                {
+                        throttle_release(jp,1);
+                        break;
+                }
+}
+
+#define EVENT_SPAWN 3
+
+static void spawn_collect(void);
+static void spawn_settle(unsigned int most);
+
+/*
+	Block until one of the n descriptors in fds is readable, or for
+	at most timeout milliseconds if that is not negative, draining job
+	output and job timers meanwhile.  A descriptor epoll cannot watch,
+	such as a regular file, is taken as ready.  Those waited for here
+	are registered under EVENT_WAITING and their index.
+
+	Postcondition: returns the index of a ready descriptor, or -1
+*/
+
+#define EVENT_WAITING (1ULL<<63)
+
+static int event_wait(int*fds,int n,int timeout)
+{
+        struct epoll_event ev,evs[64];
+        double deadline=now_seconds()+timeout/1e3;
+        int ready=-1,added,cnt,i;
+
+        if(event_init())
+                return -1;
+
+        for(added=0;added<n;added++)
+        {
+                ev.events=EPOLLIN;
+                ev.data.u64=EVENT_WAITING|added;
+
+                if(epoll_ctl(event_fd,EPOLL_CTL_ADD,fds[added],&ev))
+                {
+                        ready=added;
+                        break;
+                }
+        }
+
+        while(ready<0)
+        {
+                int left=-1;
+
+                if(timeout>=0&&(left=(deadline-now_seconds())*1e3+0.5)<0)
+                        left=0;
+
+                cnt=epoll_wait(event_fd,evs,sizeof evs/sizeof *evs,left);
+
+                for(i=0;i<cnt;i++)
+                {
+                        uint64_t data=evs[i].data.u64;
+                        Job*jp=(Job*)(uintptr_t)(data&~EVENT_KIND);
+
+                        if(data&EVENT_WAITING)
+                                ready=data&~EVENT_WAITING;
+                        else if((data&EVENT_KIND)==EVENT_TIMER)
+                                job_expired(jp);
+                        else if((data&EVENT_KIND)==EVENT_THROTTLE)
+                                throttle_tick();
+                        else if((data&EVENT_KIND)==EVENT_SPAWN)
+                                spawn_collect();
+                        else
+                                job_drain(jp);
+                }
+
+                if((cnt<0&&errno!=EINTR)||(!cnt&&!left))
+                        break;
+        }
+
+        for(i=0;i<added;i++)
+                epoll_ctl(event_fd,EPOLL_CTL_DEL,fds[i],NULL);
+
+        return ready;
+}
+
+static Job*find_job(unsigned int id)
+{
+        Job*jp;
+
+        for(jp=joblist;jp;jp=jp->next)
+                if(jp->id==id)
+                        return jp;
+
+        for(jp=donelist;jp;jp=jp->next)
+                if(jp->id==id)
+                        return jp;
+
+        return NULL;
+}
+
+/*
+	Read a /proc file of a job through a descriptor kept open on it,
+	opening it the first time.
+
+	Postcondition: returns the length read into buf, NUL-terminated,
+		       or -1
+*/
+
+static ssize_t job_proc_read(Job*jp,int*fdp,char*name,char*buf,size_t size)
+{
+        ssize_t n;
+
+        if(*fdp<0)
+        {
+                char path[64];
+
+                snprintf(path,sizeof path,"/proc/%d/%s",(int)jp->pid,name);
+
+                if((*fdp=open(path,O_RDONLY|O_CLOEXEC))<0)
+                        return -1;
+        }
+
+        if((n=pread(*fdp,buf,size-1,0))<0)
+                return -1;
+
+        buf[n]='\0';
+
+        return n;
+}
+
+/*
+	One resource sample of a job.
+*/
+
+typedef struct
+{
+        double cpu;
+        unsigned long long rss,rchar,wchar;
+        long threads;
+        int node;
+} Job_sample;
+
+static int node_of_cpu(int cpu);
+
+/*
+	Sample a job from /proc/pid/stat and /proc/pid/io.  CPU use is
+	the share of one CPU since the last sample, or over its whole
+	life the first time.  The node is the one the job is bound to,
+	or else that of the CPU it last ran on.
+
+	Postcondition: returns 0, or -1 if the job could not be read
+*/
+
+static int job_sample(Job*jp,Job_sample*sp)
+{
+        char buf[1024],*p;
+        unsigned long long utime,stime,cutime,cstime,start,ticks;
+        long rss;
+        int processor;
+        struct timespec ts;
+        double now,hz=sysconf(_SC_CLK_TCK);
+
+        memset(sp,0,sizeof *sp);
+
+        if(job_proc_read(jp,&jp->statfd,"stat",buf,sizeof buf)<0||!(p=strrchr(buf,')')))
+                return -1;
+
+        /* Fields 14-17, 20, 22, 24 and 39, counting from the pid; the
+           command name may hold spaces, so start after it. */
+        if(sscanf(p+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                  "%llu %llu %llu %llu %*d %*d %ld %*d %llu %*u %ld "
+                  "%*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*d %d",
+                  &utime,&stime,&cutime,&cstime,&sp->threads,&start,&rss,&processor)!=8)
+                return -1;
+
+        sp->node=jp->node>=0?jp->node:node_of_cpu(processor);
+
+        clock_gettime(CLOCK_BOOTTIME,&ts);
+        now=ts.tv_sec+ts.tv_nsec/1e9;
+        ticks=utime+stime+cutime+cstime;
+
+        if(jp->sampled)
+                sp->cpu=now>jp->sampled?(ticks-jp->ticks)/hz/(now-jp->sampled)*100:0;
+        else if(now>start/hz)
+                sp->cpu=ticks/hz/(now-start/hz)*100;
+
+        jp->ticks=ticks;
+        jp->sampled=now;
+        sp->rss=(unsigned long long)rss*sysconf(_SC_PAGESIZE);
+
+        if(job_proc_read(jp,&jp->iofd,"io",buf,sizeof buf)>=0)
+        {
+                if((p=strstr(buf,"rchar:")))
+                        sp->rchar=strtoull(p+6,NULL,10);
+
+                if((p=strstr(buf,"wchar:")))
+                        sp->wchar=strtoull(p+6,NULL,10);
+        }
+
+        return 0;
+}
+
+static void jobs_stats(void)
+{
+        Job_sample smp;
+        char rss[16],rd[16],wr[16],node[16];
+        Job*jp;
+
+        printf("%-4s %7s %6s %11s %4s %4s %11s %11s  %s\n","job","pid","%cpu","rss","thr","node","read","written","argv");
+
+        for(jp=joblist;jp;jp=jp->next)
+        {
+                if(job_sample(jp,&smp))
+                        continue;
+
+                format_bytes(rss,sizeof rss,smp.rss);
+                format_bytes(rd,sizeof rd,smp.rchar);
+                format_bytes(wr,sizeof wr,smp.wchar);
+
+                if(smp.node>=0)
+                        snprintf(node,sizeof node,"%d",smp.node);
+                else
+                        strcpy(node,"-");
+
+                printf("%-4u %7d %6.1f %11s %4ld %4s %11s %11s  %s\n",jp->id,(int)jp->pid,smp.cpu,rss,smp.threads,node,rd,wr,jp->cmdbuf);
+        }
+}
+
+static void reap_jobs(void);
+
+/* 
+	List currently executing background commands, and those finished
+	with captured output.  jobs -o N writes out what job N captured.
+	jobs -s shows what each running job uses: CPU, resident memory,
+	threads, NUMA node and bytes read and written.  jobs -s N shows
+	it again every N seconds, on a cleared terminal, until no job is
+	left or a line of input arrives.
+*/
+
+static int builtin_jobs(char**argv)
+{
+        Job*jp;
+
+        spawn_settle(0);
+
+        if(argv[1]&&!strcmp(argv[1],"-s"))
+        {
+                double every=0;
+                int fd=STDIN_FILENO;
+
+                if(argv[2]&&parse_duration(argv[2],&every))
+                {
+                        shfault("jobs: -s: %s: invalid interval",argv[2]);
+                        return 1;
+                }
+
+                for(;;)
+                {
+                        if(every>0&&isatty(STDOUT_FILENO))
+                                fputs("\033[H\033[J",stdout);
+
+                        jobs_stats();
+                        fflush(stdout);
+
+                        if(every<=0||!joblist||event_wait(&fd,isatty(fd),every*1e3)==0)
+                                break;
+
+                        reap_jobs();
+                }
+
+                return 0;
+        }
+
+        if(argv[1]&&!strcmp(argv[1],"-o"))
+        {
+                if(!argv[2]||!(jp=find_job(strtoul(argv[2],NULL,10))))
+                {
+                        shfault("jobs: -o: no such job");
+                        return 1;
+                }
+
+                if(!jp->ring.base)
+                {
+                        shfault("jobs: %u: output not captured",jp->id);
+                        return 1;
+                }
+
+                job_drain(jp);
+                fwrite(jp->ring.base+jp->ring.head,1,jp->ring.len,stdout);
+
+                return 0;
+        }
+
+        for(jp=joblist;jp;jp=jp->next)
+                printf("%s\tpid: %d job: %u argv: %s\n",jp->gate>=0?"Throttled":"Running",(int)jp->pid,jp->id,jp->cmdbuf);
+
+        for(jp=donelist;jp;jp=jp->next)
+                printf("Done\tpid: %d job: %u argv: %s output: %zu bytes\n",(int)jp->pid,jp->id,jp->cmdbuf,jp->ring.len);
+
+        return 0;
+}
+
+static void finish_job(Job*jp,int stat_loc);
+static int exit_status(int stat_loc);
+static int job_status(Job*jp,int stat_loc);
+
+/*
+	Parse a wait operand, %N or a process ID, to a running job.
+*/
+
+static Job*wait_operand(char*p)
+{
+        Job*jp;
+        char*end;
+        unsigned long n=strtoul(p+(*p=='%'),&end,10);
+
+        if(*end||end==p+(*p=='%'))
+                return NULL;
+
+        for(jp=joblist;jp;jp=jp->next)
+                if(*p=='%'?jp->id==n:jp->pid==(pid_t)n)
+                        return jp;
+
+        return NULL;
+}
+
+/*
+	Parse a wait operand to a job already reaped.
+
+	Postcondition: returns its index in reaped, or -1
+*/
+
+static int wait_reaped(char*p)
+{
+        char*end;
+        unsigned long n=strtoul(p+(*p=='%'),&end,10);
+        unsigned int i;
+
+        if(*end||end==p+(*p=='%'))
+                return -1;
+
+        for(i=nreaped;i-->0;)
+                if(*p=='%'?reaped[i].id==n:reaped[i].pid==(pid_t)n)
+                        return (int)i;
+
+        return -1;
+}
+
+/*
+	wait [-n] [-t ms] [%job|pid...]: wait for the given jobs, or all
+	of them, to finish, or with -n for the first of them.  Each is
+	watched through a pidfd in the event loop, so captured output
+	keeps flowing meanwhile.  A job that finished before is taken
+	from reaped, once.
+
+	Postcondition: returns the status of the last operand, of the
+		       job -n saw finish, 0 with no operands, or 124 if
+		       ms milliseconds passed first
+*/
+
+static int builtin_wait(char**argv)
+{
+        char**pp=argv+1;
+        int any=0,timeout=-1,status=0,n=0,done=0,i,j;
+        unsigned char taken[JOB_REAPED_KEEP]={0};
+        double deadline;
+        Job**jobs;
+        int*fds,*last;
+        Job*jp;
+
+        for(;*pp&&**pp=='-';pp++)
+                if(!strcmp(*pp,"-n"))
+                        any=1;
+                else if(!strcmp(*pp,"-t")&&pp[1])
+                {
+                        char*end;
+                        long ms;
+
+                        errno=0;
+                        ms=strtol(*++pp,&end,10);
+                        if(*end||end==*pp||ms<0||ms>INT_MAX||errno)
+                        {
+                                shfault("wait: %s: bad timeout",*pp);
+                                return 2;
+                        }
+
+                        timeout=(int)ms;
+                }
+                else
+                {
+                        shfault("wait: usage: wait [-n] [-t ms] [%%job|pid...]");
+                        return 2;
+                }
+
+        spawn_settle(0);
+
+        for(jp=joblist;jp;jp=jp->next)
+                n++;
+
+        if(*pp)
+                for(n=0;pp[n];n++)
+                        ;
+
+        jobs=calloc(n+1,sizeof *jobs);
+        fds=calloc(n+1,sizeof *fds);
+        last=calloc(n+1,sizeof *last);
+        if(!jobs||!fds||!last)
+                shfail("calloc");
+
+        /* last marks the final operand, whose status is returned. */
+        for(i=0,jp=joblist;i<n;i++)
+        {
+                if(*pp&&!(jp=wait_operand(pp[i])))
+                {
+                        fds[i]=-1;
+
+                        if((j=wait_reaped(pp[i]))<0)
+                        {
+                                shfault("wait: %s: no such job",pp[i]);
+                                status=127;
+                        }
+                        else if(any?!done++:i==n-1)
+                                status=reaped[j].status;
+
+                        if(j>=0)
+                                taken[j]=1;
+
+                        continue;
+                }
+
+                /* An operand naming a job again adds nothing to wait for. */
+                for(j=0;j<i&&jobs[j]!=jp;j++)
+                        ;
+
+                if(j<i)
+                {
+                        last[j]|=i==n-1;
+                        fds[i]=-1;
+                        jp=jp->next;
+                        continue;
+                }
+
+                jobs[i]=jp;
+                last[i]=*pp&&i==n-1;
+
+                if((fds[i]=syscall(SYS_pidfd_open,jp->pid,0))<0)
+                        shfault("wait: %s",strerror(errno));
+
+                jp=jp->next;
+        }
+
+        /* Drop the operands there is nothing to wait for. */
+        for(i=0;i<n;)
+                if(fds[i]<0)
+                {
+                        n--;
+                        jobs[i]=jobs[n];
+                        fds[i]=fds[n];
+                        last[i]=last[n];
+                }
+                else
+                        i++;
+
+        /* Without operands, -n takes the first job reaped, and a plain
+           wait forgets them all. */
+        if(!*pp)
+                for(j=0;j<(int)nreaped&&!(any&&done);j++)
+                {
+                        if(any&&!done++)
+                                status=reaped[j].status;
+
+                        taken[j]=1;
+                }
+
+        if(any&&done)
+        {
+                for(i=0;i<n;i++)
+                        close(fds[i]);
+
+                n=0;
+        }
+        else if(any&&!n)
+                status=127;
+
+        fflush(stdout);
+
+        /* -t bounds the whole wait, however many jobs finish. */
+        deadline=now_seconds()+timeout/1e3;
+
+        while(n>0)
+        {
+                int stat_loc=0,left=-1;
+
+                if(timeout>=0&&(left=(deadline-now_seconds())*1e3+0.5)<0)
+                        left=0;
+
+                if((i=event_wait(fds,n,left))<0)
+                {
+                        status=124;
+                        break;
+                }
+
+                while(waitpid(jobs[i]->pid,&stat_loc,0)<0&&errno==EINTR)
+                        ;
+
+                if(any||last[i])
+                        status=job_status(jobs[i],stat_loc);
+
+                finish_job(jobs[i],stat_loc);
+                close(fds[i]);
+                n--;
+                jobs[i]=jobs[n];
+                fds[i]=fds[n];
+                last[i]=last[n];
+
+                if(any)
+                        break;
+        }
+
+        for(i=0;i<n;i++)
+                close(fds[i]);
+
+        for(j=nreaped;j-->0;)
+                if(taken[j])
+                        reaped_drop(j);
+
+        free(jobs);
+        free(fds);
+        free(last);
+
+        return status;
+}
+
+extern char**environ;
+
+/* 
+	Display or modify environment variables. 
+  
+	Precondition: argv!=NULL&&*argv!=NULL
+	Postcondition: If a variable name or binding was specified,
+		       then an element of environ was added or modified.
+*/
+
+static int builtin_set(char**argv)
+{
+        char*p=argv[1];
+
+        if(!p)
+	{
+		register char**pp;
+
+                for(pp=environ;*pp;pp++)
+                        puts(*pp);
+	}
+        else
+        {
+                char*eq_flag=strchr(p,'='),*binding;
+               
+		if(eq_flag==p)
+		{
+			shfault("syntax error near: '='");
+			return 1;
+		}
+
+		binding=malloc(strlen(p)+(eq_flag?1:2));
+
+                if(!binding)
+                        shfail("malloc");
+
+                /* account for whitespace before equal sign? */
+                strcpy(binding,p);
+
+                if(!eq_flag)
+                {
+                        char*p2=&binding[strlen(p)];
+                        *p2++='=';
+                        *p2='\0';
+                }
+
+                if(putenv(binding))
+                        shfail("putenv");
+        }
+
+        return 0;
+}
+
+/*
+	Pending break and continue counts, and the number of loops
+	running; see run_loop_body().
+*/
+
+static int loop_depth,loop_break,loop_continue;
+
+/*
+	Leave the innermost loop, or the n innermost loops.
+*/
+
+static int builtin_break(char**argv)
+{
+        int n=argv[1]?atoi(argv[1]):1;
+
+        if(n<1)
+        {
+                shfault("break: %s: loop count out of range",argv[1]);
+                return 1;
+        }
+
+        if(loop_depth)
+                loop_break=n<loop_depth?n:loop_depth;
+
+        return 0;
+}
+
+/*
+	Go on to the next iteration of the innermost loop, or of the
+	n-th loop outward.
+*/
+
+static int builtin_continue(char**argv)
+{
+        int n=argv[1]?atoi(argv[1]):1;
+
+        if(n<1)
+        {
+                shfault("continue: %s: loop count out of range",argv[1]);
+                return 1;
+        }
+
+        if(loop_depth)
+                loop_continue=n<loop_depth?n:loop_depth;
+
+        return 0;
+}
+
+/*
+	Look up a variable in the environment by a name that need not be
+	NUL-terminated.
+*/
+
+static char*getvar(const char*name,size_t n)
+{
+        register char**pp;
+
+        for(pp=environ;*pp;pp++)
+                if(!strncmp(*pp,name,n)&&(*pp)[n]=='=')
+                        return *pp+n+1;
+
+        return NULL;
+}
+
+/*
+	Step over a variable name.
+
+	Postcondition: returns p itself if no name starts there
+*/
+
+static const char*scan_name(const char*p)
+{
+        if(!isalpha((int)*p)&&*p!='_')
+                return p;
+
+        while(isalnum((int)*p)||*p=='_')
+                p++;
+
+        return p;
+}
+
+/*
+	Find the '}' or ')' that closes the "${" or "$(" at p, skipping
+	nested brackets, quotes and backslash escapes.
+
+	Precondition: *p=='{'||*p=='('
+	Postcondition: returns NULL if there is none
+*/
+
+static char*bracket_end(char*p)
+{
+        int depth=0;
+        char q=0,open=*p,close=open=='{'?'}':')';
+
+        for(;*p;p++)
+        {
+                if(q)
+                {
+                        if(*p==q)
+                                q=0;
+                        else if(q=='"'&&*p=='\\'&&p[1])
+                                p++;
+
+                        continue;
+                }
+
+                switch(*p)
+                {
+                case '\\':
+                        if(p[1])
+                                p++;
+                        break;
+                case '\'':
+                case '"':
+                        q=*p;
+                        break;
+                default:
+                        if(*p==open)
+                                depth++;
+                        else if(*p==close&&!--depth)
+                                return p;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+	Bind a variable to a value for the shell and its children.
+*/
+
+static void setvar(const char*name,const char*val)
+{
+        Strbuf sb={0};
+
+        sb_putn(&sb,name,strlen(name));
+        sb_putc(&sb,'=');
+        sb_putn(&sb,val,strlen(val));
+
+        if(putenv(sb_take(&sb)))
+                shfail("putenv");
+}
+
+/*
+	Do nothing, successfully.  Also serves as ':'.
+*/
+
+static int builtin_true(char**argv)
+{
+        return 0;
+}
+
+/*
+	Do nothing, unsuccessfully.
+*/
+
+static int builtin_false(char**argv)
+{
+        return 1;
+}
+
+/*
+	The remaining arguments of a test expression; see builtin_test().
+*/
+
+static char**test_argv;
+static int test_error;
+
+/*
+	Evaluate a unary file or string primary such as -f path or -n str.
+*/
+
+static int test_unary(int op,char*arg)
+{
+        struct stat st;
+
+        switch(op)
+        {
+                case 'n':
+                        return *arg!='\0';
+                case 'z':
+                        return *arg=='\0';
+                case 't':
+                        return isatty(atoi(arg));
+                case 'r':
+                        return !access(arg,R_OK);
+                case 'w':
+                        return !access(arg,W_OK);
+                case 'x':
+                        return !access(arg,X_OK);
+                case 'h':
+                case 'L':
+                        return !lstat(arg,&st)&&S_ISLNK(st.st_mode);
+        }
+
+        if(stat(arg,&st))
+                return 0;
+
+        switch(op)
+        {
+                case 'b':
+                        return S_ISBLK(st.st_mode);
+                case 'c':
+                        return S_ISCHR(st.st_mode);
+                case 'd':
+                        return S_ISDIR(st.st_mode);
+                case 'f':
+                        return S_ISREG(st.st_mode);
+                case 'p':
+                        return S_ISFIFO(st.st_mode);
+                case 'S':
+                        return S_ISSOCK(st.st_mode);
+                case 's':
+                        return st.st_size>0;
+                case 'g':
+                        return (st.st_mode&S_ISGID)!=0;
+                case 'u':
+                        return (st.st_mode&S_ISUID)!=0;
+                case 'k':
+                        return (st.st_mode&S_ISVTX)!=0;
+        }
+
+        return 1; /* -e */
+}
+
+static int is_test_unary(const char*s)
+{
+        return s[0]=='-'&&s[1]&&!s[2]&&strchr("bcdefghknprstuwxzLS",s[1]);
+}
+
+static int is_test_binary(const char*s)
+{
+        static const char*ops[]={ "=","==","!=","<",">","-eq","-ne","-lt",
+                "-le","-gt","-ge","-nt","-ot","-ef",NULL };
+        register const char**pp;
+
+        for(pp=ops;*pp;pp++)
+                if(!strcmp(s,*pp))
+                        return 1;
+
+        return 0;
+}
+
+/*
+	Convert an operand of an arithmetic comparison.
+*/
+
+static long long test_integer(const char*s)
+{
+        char*end;
+        long long n;
+
+        errno=0;
+        n=strtoll(s,&end,10);
+
+        while(isspace((int)*end))
+                end++;
+
+        if(end==s||*end||errno)
+        {
+                shfault("test: %s: integer expression expected",s);
+                test_error=1;
+        }
+
+        return n;
+}
+
+/*
+	Evaluate a binary primary such as a = b, n -lt m or f -nt g.
+*/
+
+static int test_binary(char*l,char*op,char*r)
+{
+        struct stat ls,rs;
+
+        if(*op!='-')
+        {
+                int cmp=strcmp(l,r);
+
+                switch(*op)
+                {
+                        case '<':
+                                return cmp<0;
+                        case '>':
+                                return cmp>0;
+                        case '!':
+                                return cmp!=0;
+                }
+
+                return !cmp;
+        }
+
+        if(op[1]=='n'&&op[2]=='t')
+                return !stat(l,&ls)&&(stat(r,&rs)||ls.st_mtime>rs.st_mtime);
+
+        if(op[1]=='o'&&op[2]=='t')
+                return !stat(r,&rs)&&(stat(l,&ls)||ls.st_mtime<rs.st_mtime);
+
+        if(op[1]=='e'&&op[2]=='f')
+                return !stat(l,&ls)&&!stat(r,&rs)&&
+                       ls.st_dev==rs.st_dev&&ls.st_ino==rs.st_ino;
+
+        {
+                long long a=test_integer(l),b=test_integer(r);
+
+                if(!strcmp(op,"-eq"))
+                        return a==b;
+                else if(!strcmp(op,"-ne"))
+                        return a!=b;
+                else if(!strcmp(op,"-lt"))
+                        return a<b;
+                else if(!strcmp(op,"-le"))
+                        return a<=b;
+                else if(!strcmp(op,"-gt"))
+                        return a>b;
+
+                return a>=b;
+        }
+}
+
+static int test_or(void);
+
+/*
+	primary: '!' primary | '(' or ')' | ARG BINOP ARG | UNOP ARG | ARG
+*/
+
+static int test_primary(void)
+{
+        char**av=test_argv;
+        int r;
+
+        if(!av[0])
+        {
+                shfault("test: argument expected");
+                test_error=1;
+                return 0;
+        }
+
+        if(!strcmp(av[0],"!")&&av[1])
+        {
+                test_argv++;
+                return !test_primary();
+        }
+
+        if(av[1]&&av[2]&&is_test_binary(av[1]))
+        {
+                test_argv+=3;
+                return test_binary(av[0],av[1],av[2]);
+        }
+
+        if(!strcmp(av[0],"(")&&av[1])
+        {
+                test_argv++;
+                r=test_or();
+
+                if(!*test_argv||strcmp(*test_argv,")"))
+                {
+                        shfault("test: ')' expected");
+                        test_error=1;
+                }
+                else
+                        test_argv++;
+
+                return r;
+        }
+
+        if(is_test_unary(av[0])&&av[1])
+        {
+                test_argv+=2;
+                return test_unary(av[0][1],av[1]);
+        }
+
+        test_argv++;
+
+        return *av[0]!='\0';
+}
+
+/*
+	and: primary ('-a' primary)*
+	or:  and ('-o' and)*
+*/
+
+static int test_and(void)
+{
+        int r=test_primary();
+
+        while(*test_argv&&!strcmp(*test_argv,"-a"))
+        {
+                test_argv++;
+                r=test_primary()&&r;
+        }
+
+        return r;
+}
+
+static int test_or(void)
+{
+        int r=test_and();
+
+        while(*test_argv&&!strcmp(*test_argv,"-o"))
+        {
+                test_argv++;
+                r=test_and()||r;
+        }
+
+        return r;
+}
+
+/*
+	POSIX decides by the number of arguments, up to four, before any
+	grammar: [ ! = x ] compares strings, for one.
+
+	Postcondition: returns 1 if true, 0 if false, -1 if the grammar
+		       has to decide
+*/
+
+static int test_count(char**av,int n)
+{
+        int r;
+
+        switch(n)
+        {
+                case 0:
+                        return 0;
+                case 1:
+                        return *av[0]!='\0';
+                case 2:
+                        if(!strcmp(av[0],"!"))
+                                return !test_count(av+1,1);
+
+                        if(is_test_unary(av[0]))
+                                return test_unary(av[0][1],av[1]);
+
+                        break;
+                case 3:
+                        if(is_test_binary(av[1]))
+                                return test_binary(av[0],av[1],av[2]);
+
+                        if(!strcmp(av[1],"-a"))
+                                return *av[0]&&*av[2];
+
+                        if(!strcmp(av[1],"-o"))
+                                return *av[0]||*av[2];
+
+                        if(!strcmp(av[0],"!"))
+                                return (r=test_count(av+1,2))<0?r:!r;
+
+                        if(!strcmp(av[0],"(")&&!strcmp(av[2],")"))
+                                return test_count(av+1,1);
+
+                        break;
+                case 4:
+                        if(!strcmp(av[0],"!"))
+                                return (r=test_count(av+1,3))<0?r:!r;
+
+                        if(!strcmp(av[0],"(")&&!strcmp(av[3],")"))
+                                return test_count(av+1,2);
+
+                        break;
+        }
+
+        return -1;
+}
+
+/*
+	Evaluate a conditional expression, as test or [ ... ].
+
+	Postcondition: returns 0 if true, 1 if false, 2 on error
+*/
+
+static int builtin_test(char**argv)
+{
+        char**end,*last=NULL;
+        int r;
+
+        for(end=argv;*end;end++);
+
+        if(!strcmp(*argv,"["))
+        {
+                if(end==argv+1||strcmp(end[-1],"]"))
+                {
+                        shfault("[: missing ']'");
+                        return 2;
+                }
+
+                last=*--end;
+                *end=NULL;
+        }
+
+        test_argv=argv+1;
+        test_error=0;
+
+        if((r=test_count(test_argv,end-test_argv))<0)
+        {
+                r=test_or();
+
+                if(*test_argv&&!test_error)
+                {
+                        shfault("test: %s: unexpected operator",*test_argv);
+                        test_error=1;
+                }
+        }
+
+        if(last)
+                *end=last;
+
+        return test_error?2:!r;
+}
+
+/*
+	Output the character for the escape sequence after a backslash
+	in a printf format or a %b argument.  With octal!=0 a \0 may be
+	followed by up to three more octal digits, as %b allows.
+
+	Postcondition: returns the character after the sequence, or
+		       NULL for \c, which ends all output
+*/
+
+static char*put_escape(char*p,int octal)
+{
+        register int c=0,n;
+
+        switch(*p)
+        {
+                case 'a':
+                        c='\a';
+                        break;
+                case 'b':
+                        c='\b';
+                        break;
+                case 'c':
+                        return NULL;
+                case 'e':
+                        c='\033';
+                        break;
+                case 'f':
+                        c='\f';
+                        break;
+                case 'n':
+                        c='\n';
+                        break;
+                case 'r':
+                        c='\r';
+                        break;
+                case 't':
+                        c='\t';
+                        break;
+                case 'v':
+                        c='\v';
+                        break;
+                case '\\':
+                        c='\\';
+                        break;
+                case '\0':
+                        putchar('\\');
+                        return p;
+                default:
+                        if(*p<'0'||*p>'7')
+                        {
+                                putchar('\\');
+                                putchar(*p);
+                                return p+1;
+                        }
+
+                        if(octal&&*p=='0')
+                                p++;
+
+                        for(n=0;n<3&&*p>='0'&&*p<='7';n++)
+                                c=c*8+*p++-'0';
+
+                        putchar(c);
+                        return p;
+        }
+
+        putchar(c);
+
+        return p+1;
+}
+
+/*
+	Convert a numeric printf argument; 'c or "c gives the value of
+	the character c.
+*/
+
+static int printf_error;
+
+static long long printf_integer(const char*s)
+{
+        char*end;
+        long long n;
+
+        if(!s)
+                return 0;
+
+        if(*s=='\''||*s=='"')
+                return (unsigned char)s[1];
+
+        errno=0;
+        n=strtoll(s,&end,0);
+
+        if(end==s||*end||errno)
+        {
+                shfault("printf: %s: invalid number",s);
+                printf_error=1;
+        }
+
+        return n;
+}
+
+/*
+	Format and print data, reusing the format while arguments remain.
+*/
+
+static int builtin_printf(char**argv)
+{
+        char**args,*fmt=argv[1];
+        register char*p;
+
+        if(!fmt)
+        {
+                shfault("printf: usage: printf format [arguments]");
+                return 2;
+        }
+
+        args=argv+2;
+        printf_error=0;
+
+        do
+        {
+                char**first=args;
+
+                for(p=fmt;*p;)
+                {
+                        char spec[64],*arg;
+                        size_t n=1;
+                        int conv;
+
+                        if(*p=='\\')
+                        {
+                                if(!(p=put_escape(p+1,0)))
+                                        return printf_error;
+
+                                continue;
+                        }
+
+                        if(*p!='%')
+                        {
+                                putchar(*p++);
+                                continue;
+                        }
+
+                        if(p[1]=='%')
+                        {
+                                putchar('%');
+                                p+=2;
+                                continue;
+                        }
+
+                        /* Rebuild the conversion for the C library with
+                           any '*' replaced by its argument. */
+                        spec[0]='%';
+
+                        for(p++;*p&&strchr("-+ #0'",*p)&&n<8;p++)
+                                spec[n++]=*p;
+
+                        while((*p=='*'||isdigit((int)*p)||*p=='.')&&n<40)
+                        {
+                                if(*p=='*')
+                                {
+                                        n+=snprintf(spec+n,sizeof spec-n,"%d",
+                                                (int)printf_integer(*args?*args++:NULL));
+                                        p++;
+                                }
+                                else
+                                        spec[n++]=*p++;
+                        }
+
+                        conv=*p++;
+                        arg=*args?*args++:NULL;
+
+                        switch(conv)
+                        {
+                                case 'd':
+                                case 'i':
+                                        strcpy(spec+n,"lld");
+                                        printf(spec,printf_integer(arg));
+                                        break;
+                                case 'o':
+                                case 'u':
+                                case 'x':
+                                case 'X':
+                                        spec[n++]='l';
+                                        spec[n++]='l';
+                                        spec[n++]=conv;
+                                        spec[n]='\0';
+                                        printf(spec,(unsigned long long)printf_integer(arg));
+                                        break;
+                                case 'a':
+                                case 'A':
+                                case 'e':
+                                case 'E':
+                                case 'f':
+                                case 'F':
+                                case 'g':
+                                case 'G':
+                                        spec[n++]=conv;
+                                        spec[n]='\0';
+                                        printf(spec,arg?strtod(arg,NULL):0.0);
+                                        break;
+                                case 'c':
+                                        strcpy(spec+n,"c");
+                                        if(arg&&*arg)
+                                                printf(spec,*arg);
+                                        break;
+                                case 's':
+                                        strcpy(spec+n,"s");
+                                        printf(spec,arg?arg:"");
+                                        break;
+                                case 'b':
+                                        for(arg=arg?arg:"";*arg;)
+                                        {
+                                                if(*arg!='\\')
+                                                        putchar(*arg++);
+                                                else if(!(arg=put_escape(arg+1,1)))
+                                                        return printf_error;
+                                        }
+
+                                        break;
+                                default:
+                                        shfault("printf: %%%c: invalid directive",conv?conv:' ');
+                                        return 1;
+                        }
+                }
+
+                if(args==first)
+                        break;
+
+        } while(*args);
+
+        return printf_error;
+}
+
+/*
+	Read one line from fd without taking anything past its newline,
+	so a command run afterwards sees the rest.  A seekable file is
+	read a block at a time, the line found with memchr() and the
+	offset put back; a pipe or terminal has to go a byte at a time.
+
+	Postcondition: returns 0 for a line, 1 at end of input
+*/
+
+static int fd_getline(int fd,Strbuf*sb)
+{
+        char buf[BUFSIZ],*nl;
+        int seekable=lseek(fd,0,SEEK_CUR)>=0;
+        ssize_t n;
+
+        for(;;)
+        {
+                n=read(fd,buf,seekable?sizeof buf:1);
+
+                if(n<0&&errno==EINTR)
+                        continue;
+
+                if(n<=0)
+                        return 1;
+
+                nl=memchr(buf,'\n',n);
+                if(nl)
+                {
+                        sb_putn(sb,buf,nl-buf);
+
+                        if(seekable&&nl+1<buf+n)
+                                lseek(fd,(nl+1)-(buf+n),SEEK_CUR);
+
+                        return 0;
+                }
+
+                sb_putn(sb,buf,n);
+        }
+}
+
+/*
+	Read a line from standard input into the named variables (REPLY
+	by default).  It is split at IFS characters, the last variable
+	taking what remains; without -r a backslash quotes the character
+	after it and joins a line to the next.
+*/
+
+static int builtin_read(char**argv)
+{
+        static char*reply[]={ "REPLY",NULL };
+        char**names,*ifs=getvar("IFS",3),*prompt=NULL;
+        Strbuf line={0},field={0};
+        register char*p;
+        int raw=0,status;
+
+        for(names=argv+1;*names&&**names=='-';names++)
+        {
+                if(!strcmp(*names,"-r"))
+                        raw=1;
+                else if(!strcmp(*names,"-p")&&names[1])
+                        prompt=*++names;
+                else if(!strcmp(*names,"--"))
+                {
+                        names++;
+                        break;
+                }
+                else
+                {
+                        shfault("read: %s: invalid option",*names);
+                        return 2;
+                }
+        }
+
+        if(!*names)
+                names=reply;
+
+        if(!ifs)
+                ifs=" \t\n";
+
+        if(prompt&&isatty(STDIN_FILENO))
+                fputs(prompt,stderr);
+
+        fflush(stdout);
+
+        while(!(status=fd_getline(STDIN_FILENO,&line))&&!raw)
+        {
+                size_t i,bs=0;
+
+                for(i=line.len;i>0&&line.s[i-1]=='\\';i--)
+                        bs++;
+
+                if(!(bs&1))
+                        break;
+
+                line.s[--line.len]='\0';
+        }
+
+        sb_grow(&line,0);
+        line.s[line.len]='\0';
+        p=line.s;
+
+        /* Leading IFS whitespace is never part of a field. */
+        while(*p&&strchr(ifs,*p)&&isspace((int)*p))
+                p++;
+
+        for(;*names;names++)
+        {
+                size_t keep=0;
+
+                field.len=0;
+
+                while(*p)
+                {
+                        if(*p=='\\'&&!raw&&p[1])
+                        {
+                                sb_putc(&field,p[1]);
+                                p+=2;
+                                keep=field.len;
+                                continue;
+                        }
+
+                        if(strchr(ifs,*p)&&names[1])
+                        {
+                                /* One delimiter: a run of IFS whitespace
+                                   with at most one other IFS character. */
+                                int other=0;
+
+                                for(;*p&&strchr(ifs,*p);p++)
+                                        if(!isspace((int)*p)&&other++)
+                                                break;
+
+                                break;
+                        }
+
+                        sb_putc(&field,*p++);
+
+                        if(!strchr(ifs,p[-1])||!isspace((int)p[-1]))
+                                keep=field.len;
+                }
+
+                /* The last variable drops trailing IFS whitespace. */
+                field.len=keep;
+                sb_grow(&field,0);
+                field.s[field.len]='\0';
+
+                setvar(*names,field.s);
+        }
+
+        free(line.s);
+        free(field.s);
+
+        return status;
+}
+
+/*
+	Block SIGPIPE in the calling thread, so that writing to a closed
+	pipe from a builtin is an EPIPE error and not the end of the
+	shell.
+*/
+
+static void block_sigpipe(sigset_t*oldset)
+{
+        sigset_t pipeset;
+
+        sigemptyset(&pipeset);
+        sigaddset(&pipeset,SIGPIPE);
+        pthread_sigmask(SIG_BLOCK,&pipeset,oldset);
+}
+
+/*
+	Undo block_sigpipe(), first discarding any SIGPIPE left pending.
+*/
+
+static void restore_sigpipe(const sigset_t*oldset)
+{
+        if(!sigismember(oldset,SIGPIPE))
+        {
+                struct timespec zero={0,0};
+                sigset_t pipeset;
+
+                sigemptyset(&pipeset);
+                sigaddset(&pipeset,SIGPIPE);
+
+                while(sigtimedwait(&pipeset,NULL,&zero)>0)
+                        ;
+        }
+
+        pthread_sigmask(SIG_SETMASK,oldset,NULL);
+}
+
+/*
+	Write all of p to fd, across short writes.
+
+	Postcondition: returns -1, with errno set, on failure
+*/
+
+static int write_all(int fd,const char*p,size_t n)
+{
+        ssize_t done;
+
+        for(;n;p+=done,n-=done)
+        {
+                done=write(fd,p,n);
+
+                if(done<0)
+                {
+                        if(errno==EINTR)
+                        {
+                                done=0;
+                                continue;
+                        }
+
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+#define TEE_BUFSIZE 65536
+
+/*
+	Drain n bytes from a scratch pipe into fd: by splice(), or by read
+	and write where fd takes no splice (O_APPEND, a terminal).
+
+	Postcondition: returns -1, with errno set, on a write failure
+*/
+
+static int tee_drain(int scratch,int fd,size_t n)
+{
+        char buf[TEE_BUFSIZE];
+        ssize_t done;
+        int copy=0;
+
+        while(n)
+        {
+                if(!copy)
+                {
+                        done=splice(scratch,NULL,fd,NULL,n,SPLICE_F_MOVE);
+
+                        if(done<0&&errno==EINVAL)
+                        {
+                                copy=1;
+                                continue;
+                        }
+                }
+                else if((done=read(scratch,buf,n<sizeof buf?n:sizeof buf))>0&&
+                        write_all(fd,buf,done))
+                        done=-1;
+
+                if(done<0)
+                {
+                        if(errno==EINTR)
+                                continue;
+
+                        return -1;
+                }
+
+                n-=done;
+        }
+
+        return 0;
+}
+
+/*
+	Throw away n bytes a scratch pipe took beyond what was consumed
+	from the input, which the next round duplicates again.
+*/
+
+static void tee_discard(int scratch,size_t n)
+{
+        char buf[TEE_BUFSIZE];
+        ssize_t done;
+
+        while(n)
+        {
+                done=read(scratch,buf,n<sizeof buf?n:sizeof buf);
+
+                if(done<0&&errno==EINTR)
+                        continue;
+
+                if(done<=0)
+                        break;
+
+                n-=done;
+        }
+}
+
+/*
+	Drop an output that could not be written.  As with SIGPIPE for an
+	external tee, a reader going away from standard output ends the
+	whole copy, quietly.
+*/
+
+static void tee_failed(int*fds,char**names,int n,int i,int*status)
+{
+        if(errno!=EPIPE)
+                shfault("tee: %s: %s",names[i],strerror(errno));
+
+        *status=1;
+
+        if(!i&&errno==EPIPE)
+                while(n--)
+                        fds[n]=-1;
+
+        fds[i]=-1;
+}
+
+/*
+	Fan a pipe out to fds[0..n).  Each round takes what the pipe holds:
+	tee(2) duplicates it into a scratch pipe for every output but the
+	last, splice(2) moves it into the last one, and each scratch pipe
+	is spliced on to its output.  The data is only ever referenced, not
+	copied.  A round is as long as the least any output took, counted
+	in got[]; the rest is discarded.  An output that fails is reported
+	and dropped.
+*/
+
+static int tee_splice(int in,int*fds,char**names,int n)
+{
+        int(*scratch)[2]=calloc(n,sizeof *scratch),status=0,i,last;
+        ssize_t*got=calloc(n,sizeof *got),len;
+        long size=fcntl(in,F_GETPIPE_SZ),had;
+
+        if(!scratch||!got)
+                shfail("calloc");
+
+        for(i=0;i<n;i++)
+        {
+                if(pipe2(scratch[i],O_CLOEXEC)<0)
+                        shfail("pipe");
+
+                /* As many slots as the input, so a round always fits;
+                   if a pipe is kept smaller, rounds are too. */
+                if(size>0)
+                {
+                        if((had=fcntl(scratch[i][1],F_SETPIPE_SZ,size))<0)
+                                had=fcntl(scratch[i][1],F_GETPIPE_SZ);
+
+                        if(had>0&&had<size)
+                                size=had;
+                }
+        }
+
+        if(size<=0)
+                size=TEE_BUFSIZE;
+
+        for(;;)
+        {
+                for(last=n-1;last>=0&&fds[last]<0;last--)
+                        ;
+
+                if(last<0)
+                        break;
+
+                for(len=-1,i=0;i<=last;i++)
+                {
+                        if(fds[i]<0)
+                                continue;
+
+                        do
+                                got[i]=i==last?splice(in,NULL,scratch[i][1],NULL,len<0?size:len,SPLICE_F_MOVE):
+                                               tee(in,scratch[i][1],len<0?size:len,0);
+                        while(got[i]<0&&errno==EINTR);
+
+                        if(got[i]<0)
+                        {
+                                shfault("tee: %s",strerror(errno));
+                                status=1;
+                                len=0;
+                                break;
+                        }
+
+                        if(len<0||got[i]<len)
+                                len=got[i];
+                }
+
+                if(len<=0)
+                        break;
+
+                for(i=0;i<=last;i++)
+                {
+                        if(fds[i]<0)
+                                continue;
+
+                        if(tee_drain(scratch[i][0],fds[i],len))
+                                tee_failed(fds,names,n,i,&status);
+
+                        if(got[i]>len)
+                                tee_discard(scratch[i][0],got[i]-len);
+                }
+        }
+
+        for(i=0;i<n;i++)
+        {
+                close(scratch[i][0]);
+                close(scratch[i][1]);
+        }
+
+        free(scratch);
+        free(got);
+
+        return status;
+}
+
+/*
+	Fan any other input out with read() and write().
+*/
+
+static int tee_copy(int in,int*fds,char**names,int n)
+{
+        char buf[TEE_BUFSIZE];
+        ssize_t got;
+        int status=0,live=n,i;
+
+        while(live)
+        {
+                got=read(in,buf,sizeof buf);
+
+                if(got<0&&errno==EINTR)
+                        continue;
+
+                if(got<0)
+                {
+                        shfault("tee: %s",strerror(errno));
+                        return 1;
+                }
+
+                if(!got)
+                        break;
+
+                for(i=0;i<n;i++)
+                        if(fds[i]>=0&&write_all(fds[i],buf,got))
+                        {
+                                tee_failed(fds,names,n,i,&status);
+                                live=fds[0]<0?0:live-1;
+                        }
+        }
+
+        return status;
+}
+
+/*
+	tee [-a] [file...] from in to out.  A pipeline stage runs this in a
+	helper thread on the pipe ends themselves.
+*/
+
+static int tee_fds(int in,int out,char**argv)
+{
+        int*fds,*files,append=0,status=0,n=1,i;
+        char**names,**pp;
+        sigset_t oldset;
+        struct stat st;
+
+        for(pp=argv+1;*pp&&**pp=='-'&&(*pp)[1];pp++)
+        {
+                if(!strcmp(*pp,"--"))
+                {
+                        pp++;
+                        break;
+                }
+
+                if(strcmp(*pp,"-a"))
+                {
+                        shfault("tee: %s: invalid option",*pp);
+                        return 2;
+                }
+
+                append=1;
+        }
+
+        for(i=0;pp[i];i++)
+                ;
+
+        fds=malloc((i+1)*sizeof *fds);
+        files=malloc((i+1)*sizeof *files);
+        names=malloc((i+1)*sizeof *names);
+        if(!fds||!files||!names)
+                shfail("malloc");
+
+        fds[0]=out;
+        names[0]="standard output";
+
+        for(;*pp;pp++)
+        {
+                int fd=open(*pp,O_WRONLY|O_CREAT|O_CLOEXEC|(append?O_APPEND:O_TRUNC),0666);
+
+                if(fd<0)
+                {
+                        shfault("tee: %s: %s",*pp,strerror(errno));
+                        status=1;
+                        continue;
+                }
+
+                names[n]=*pp;
+                files[n]=fd;
+                fds[n++]=fd;
+        }
+
+        block_sigpipe(&oldset);
+
+        if(!fstat(in,&st)&&S_ISFIFO(st.st_mode))
+                status|=tee_splice(in,fds,names,n);
+        else
+                status|=tee_copy(in,fds,names,n);
+
+        restore_sigpipe(&oldset);
+
+        /* Failed outputs are -1 in fds by now. */
+        for(i=1;i<n;i++)
+                close(files[i]);
+
+        free(fds);
+        free(files);
+        free(names);
+
+        return status;
+}
+
+static int builtin_tee(char**argv)
+{
+        fflush(stdout);
+
+        return tee_fds(STDIN_FILENO,STDOUT_FILENO,argv);
+}
+
+/*
+	Counters of a meter stage.  A stall is a time the stage found its
+	input empty (the stage before it is the slower) or its output full
+	(the stage after it is).
+*/
+
+typedef struct Meter_def
+{
+        const char*label;
+        double start,interval,next;
+        unsigned long long bytes,last_bytes;
+        unsigned long in_stalls,out_stalls;
+        double in_wait,out_wait;
+} Meter;
+
+static void meter_report(Meter*mp,int final)
+{
+        double t=now_seconds(),elapsed=t-mp->start;
+        char rate[32];
+
+        if(final)
+        {
+                format_rate(rate,sizeof rate,mp->bytes,elapsed);
+                fprintf(stderr,"%s: %llu bytes in %.2fs, %s; waited %.2fs for input (%lu stalls), "
+                               "%.2fs for output (%lu stalls)\n",mp->label,mp->bytes,elapsed,rate,
+                               mp->in_wait,mp->in_stalls,mp->out_wait,mp->out_stalls);
+                return;
+        }
+
+        format_rate(rate,sizeof rate,mp->bytes-mp->last_bytes,t-(mp->next-mp->interval));
+        fprintf(stderr,"%s: %llu bytes, %s\n",mp->label,mp->bytes,rate);
+        mp->last_bytes=mp->bytes;
+        mp->next=t+mp->interval;
+}
+
+/*
+	Wait for fd to be ready, counting the stall against input or
+	output, and reporting live along the way.
+*/
+
+static void meter_wait(Meter*mp,int fd,int out)
+{
+        struct pollfd pfd;
+        double t=now_seconds();
+        int n;
+
+        pfd.fd=fd;
+        pfd.events=out?POLLOUT:POLLIN;
+
+        for(;;)
+        {
+                int timeout=-1;
+
+                if(mp->interval>0)
+                {
+                        double left=mp->next-now_seconds();
+
+                        if(left<=0)
+                        {
+                                meter_report(mp,0);
+                                left=mp->interval;
+                        }
+
+                        timeout=(int)(left*1000)+1;
+                }
+
+                n=poll(&pfd,1,timeout);
+
+                if(n>0||(n<0&&errno!=EINTR))
+                        break;
+        }
+
+        t=now_seconds()-t;
+
+        if(out)
+        {
+                mp->out_stalls++;
+                mp->out_wait+=t;
+        }
+        else
+        {
+                mp->in_stalls++;
+                mp->in_wait+=t;
+        }
+}
+
+static int fd_ready(int fd,int out)
+{
+        struct pollfd pfd;
+
+        pfd.fd=fd;
+        pfd.events=out?POLLOUT:POLLIN;
+
+        return poll(&pfd,1,0)>0;
+}
+
+#define METER_CHUNK (1<<20)
+
+/*
+	meter [-i seconds] [label]: pass in to out unchanged, by splice()
+	when either end is a pipe, counting bytes and stalls.  The figures
+	go to standard error at the end, and every interval with -i.
+*/
+
+static int meter_fds(int in,int out,char**argv)
+{
+        Meter m={ .label="meter" };
+        char buf[TEE_BUFSIZE],**pp=argv+1;
+        struct stat st;
+        sigset_t oldset;
+        int spliced=0,status=0;
+        ssize_t n;
+
+        if(*pp&&!strcmp(*pp,"-i"))
+        {
+                if(!pp[1]||(m.interval=strtod(pp[1],NULL))<=0)
+                {
+                        shfault("meter: -i: a number of seconds is needed");
+                        return 2;
+                }
+
+                pp+=2;
+        }
+
+        if(*pp&&(**pp=='-'||pp[1]))
+        {
+                shfault("meter: usage: meter [-i seconds] [label]");
+                return 2;
+        }
+
+        if(*pp)
+                m.label=*pp;
+
+        if((!fstat(in,&st)&&S_ISFIFO(st.st_mode))||(!fstat(out,&st)&&S_ISFIFO(st.st_mode)))
+                spliced=1;
+
+        block_sigpipe(&oldset);
+        m.start=now_seconds();
+        m.next=m.start+m.interval;
+
+        for(;;)
+        {
+                if(m.interval>0&&now_seconds()>=m.next)
+                        meter_report(&m,0);
+
+                if(spliced)
+                {
+                        n=splice(in,NULL,out,NULL,METER_CHUNK,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+                        if(n<0&&errno==EINVAL&&!m.bytes)
+                        {
+                                spliced=0;
+                                continue;
+                        }
+
+                        /* Whichever end is not ready held it up. */
+                        if(n<0&&errno==EAGAIN)
+                        {
+                                if(fd_ready(in,0))
+                                        meter_wait(&m,out,1);
+                                else
+                                        meter_wait(&m,in,0);
+
+                                continue;
+                        }
+                }
+                else
+                {
+                        if(!fd_ready(in,0))
+                                meter_wait(&m,in,0);
+
+                        if((n=read(in,buf,sizeof buf))>0)
+                        {
+                                if(!fd_ready(out,1))
+                                        meter_wait(&m,out,1);
+
+                                if(write_all(out,buf,n))
+                                        n=-1;
+                        }
+                }
+
+                if(n>0)
+                        m.bytes+=n;
+                else if(!n)
+                        break;
+                else if(errno!=EINTR)
+                {
+                        if(errno!=EPIPE)
+                        {
+                                shfault("meter: %s",strerror(errno));
+                                status=1;
+                        }
+
+                        break;
+                }
+        }
+
+        restore_sigpipe(&oldset);
+        meter_report(&m,1);
+
+        return status;
+}
+
+static int builtin_meter(char**argv)
+{
+        fflush(stdout);
+
+        return meter_fds(STDIN_FILENO,STDOUT_FILENO,argv);
+}
+
+/*
+	Move the rest of in to out without passing it through user space
+	where the kernel allows: copy_file_range() first, which can share
+	extents or copy on the server, then sendfile(), then read() and
+	write() as the last resort.  Each step down happens only when the
+	kernel refuses the one before, so a partial copy carries on from
+	the current offsets.
+
+	Postcondition: returns 0, or -1 with errno set
+*/
+
+#define COPY_CHUNK (1<<30)
+
+static int copy_data(int in,int out,off_t*bytes)
+{
+        char buf[TEE_BUFSIZE];
+        int method=0;
+        ssize_t n;
+
+        for(;;)
+        {
+                if(method==0)
+                        n=copy_file_range(in,NULL,out,NULL,COPY_CHUNK,0);
+                else if(method==1)
+                        n=sendfile(out,in,NULL,COPY_CHUNK);
+                else if((n=read(in,buf,sizeof buf))>0&&write_all(out,buf,n))
+                        return -1;
+
+                if(n>0)
+                        *bytes+=n;
+                else if(!n)
+                        return 0;
+                else if(method<2&&(errno==EXDEV||errno==EINVAL||errno==ENOSYS||errno==EOPNOTSUPP))
+                        method++;
+                else if(errno!=EINTR)
+                        return -1;
+        }
+}
+
+/*
+	copy [-v] source dest: copy a file, or into a directory under the
+	same name, keeping its permission bits.  -v reports the rate to
+	standard error.  Like any builtin it forks when run with &.
+*/
+
+static int builtin_copy(char**argv)
+{
+        char**pp=argv+1,*src,*dest,rate[32];
+        struct stat sst,dst;
+        Strbuf sb={0};
+        off_t bytes=0;
+        int verbose=0,in,out,status=0;
+        double t;
+
+        if(*pp&&!strcmp(*pp,"-v"))
+        {
+                verbose=1;
+                pp++;
+        }
+
+        if(!pp[0]||!pp[1]||pp[2])
+        {
+                shfault("copy: usage: copy [-v] source dest");
+                return 2;
+        }
+
+        src=pp[0];
+        dest=pp[1];
+
+        if((in=open(src,O_RDONLY|O_CLOEXEC))<0||fstat(in,&sst))
+        {
+                shfault("copy: %s: %s",src,strerror(errno));
+
+                if(in>=0)
+                        close(in);
+
+                return 1;
+        }
+
+        if(S_ISDIR(sst.st_mode))
+        {
+                shfault("copy: %s: Is a directory",src);
+                close(in);
+                return 1;
+        }
+
+        if(!stat(dest,&dst)&&S_ISDIR(dst.st_mode))
+        {
+                char*base=strrchr(src,'/');
+
+                base=base?base+1:src;
+                sb_putn(&sb,dest,strlen(dest));
+                sb_putc(&sb,'/');
+                sb_putn(&sb,base,strlen(base));
+                dest=sb.s;
+        }
+
+        /* Truncating the source would lose it. */
+        if(!stat(dest,&dst)&&dst.st_dev==sst.st_dev&&dst.st_ino==sst.st_ino)
+        {
+                shfault("copy: %s and %s are the same file",src,dest);
+                close(in);
+                free(sb.s);
+                return 1;
+        }
+
+        if((out=open(dest,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,sst.st_mode&07777))<0)
+        {
+                shfault("copy: %s: %s",dest,strerror(errno));
+                close(in);
+                free(sb.s);
+                return 1;
+        }
+
+        t=now_seconds();
+
+        if(copy_data(in,out,&bytes))
+        {
+                shfault("copy: %s: %s",src,strerror(errno));
+                status=1;
+        }
+
+        if(close(out))
+        {
+                shfault("copy: %s: %s",dest,strerror(errno));
+                status=1;
+        }
+
+        close(in);
+
+        if(verbose)
+        {
+                t=now_seconds()-t;
+                format_rate(rate,sizeof rate,bytes,t);
+                fprintf(stderr,"%s -> %s: %lld bytes in %.2fs, %s\n",src,dest,(long long)bytes,t,rate);
+        }
+
+        free(sb.s);
+
+        return status;
+}
+
+/*
+	Set while expanding a pattern operand, and while expanding inside
+	double quotes, so that quoted characters can be told apart from
+	glob characters.
+*/
+
+static int expand_glob,expand_quoted;
+
+/*
+	Append a quoted character.  In a pattern it is escaped so that
+	the glob compiler takes it literally.
+*/
+
+static void sb_putq(Strbuf*sb,int c)
+{
+        if(expand_glob&&c&&strchr("*?[]\\",c))
+                sb_putc(sb,'\\');
+
+        sb_putc(sb,c);
+}
+
+/*
+	Append the value of a substitution.  Unless fields==NULL (quoted
+	context) the value is split into fields at whitespace.
+*/
+
+static void put_value(Strbuf*sb,const char*val,size_t n,Vec*fields,int*have)
+{
+        register size_t i;
+
+        if(!fields)
+        {
+                if(expand_glob&&expand_quoted)
+                        for(i=0;i<n;i++)
+                                sb_putq(sb,val[i]);
+                else
+                        sb_putn(sb,val,n);
+
+                return;
+        }
+
+        for(i=0;i<n;i++)
+        {
+                if(isspace((int)(unsigned char)val[i]))
+                {
+                        if(*have)
+                                vec_push(fields,sb_take(sb));
+
+                        *have=0;
+                }
+                else
+                {
+                        sb_putc(sb,val[i]);
+                        *have=1;
+                }
+        }
+}
+
+/*
+	Set when a word cannot be expanded; the command using it is not
+	run.
+*/
+
+static int expand_error;
+
+/*
+	The status of the last command substitution, which is also that
+	of a command made only of assignments.
+*/
+
+static int subst_status;
+
+static char*expand_string(char*w);
+static char*expand_command(char*p,Strbuf*sb,Vec*fields,int*have);
+static char*expand_procsubst(char*p,Strbuf*sb,Vec*fields,int*have);
+
+/*
+	A compiled arithmetic expression.  Trees are kept in arith_cache
+	by source text, so an expression in a loop body is parsed only the
+	first time it is evaluated.
+*/
+
+enum { A_NUM, A_VAR, A_NEG, A_NOT, A_BNOT, A_PREINC, A_PREDEC, A_POSTINC,
+       A_POSTDEC, A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR, A_LT,
+       A_LE, A_GT, A_GE, A_EQ, A_NE, A_BAND, A_XOR, A_BOR, A_LAND, A_LOR,
+       A_COND, A_ASSIGN, A_COMMA };
+
+typedef struct Arith_def
+{
+        int op,aop;
+        long long val;
+        char*name;
+        struct Arith_def*l,*r,*c;
+} Arith;
+
+typedef struct Arith_cache_def
+{
+        char*text;
+        Arith*tree;
+        struct Arith_cache_def*next;
+} Arith_cache;
+
+#define ARITH_BUCKETS 256
+#define ARITH_CACHE_MAX 4096
+
+static Arith_cache*arith_cache[ARITH_BUCKETS];
+static unsigned int arith_cached;
+
+/*
+	Binary operators by precedence, longest spelling first.
+*/
+
+static const struct
+{
+        const char*s;
+        int op,prec;
+} arith_ops[]=
+{
+        { "||",A_LOR,1 }, { "&&",A_LAND,2 }, { "|",A_BOR,3 }, { "^",A_XOR,4 },
+        { "&",A_BAND,5 }, { "==",A_EQ,6 }, { "!=",A_NE,6 }, { "<=",A_LE,7 },
+        { ">=",A_GE,7 }, { "<<",A_SHL,8 }, { ">>",A_SHR,8 }, { "<",A_LT,7 },
+        { ">",A_GT,7 }, { "+",A_ADD,9 }, { "-",A_SUB,9 }, { "*",A_MUL,10 },
+        { "/",A_DIV,10 }, { "%",A_MOD,10 }, { NULL,0,0 }
+};
+
+static const char*arith_p;
+static int arith_error;
+
+static Arith*arith_node(int op,Arith*l,Arith*r)
+{
+        Arith*a=calloc(1,sizeof *a);
+
+        if(!a)
+                shfail("calloc");
+
+        a->op=op;
+        a->l=l;
+        a->r=r;
+
+        return a;
+}
+
+static void arith_free(Arith*a)
+{
+        if(a)
+        {
+                arith_free(a->l);
+                arith_free(a->r);
+                arith_free(a->c);
+                free(a->name);
+                free(a);
+        }
+}
+
+static void arith_fault(const char*msg)
+{
+        if(!arith_error)
+                shfault("arithmetic: %s near '%s'",msg,*arith_p?arith_p:"end");
+
+        arith_error=1;
+}
+
+static void arith_space(void)
+{
+        while(isspace((int)*arith_p))
+                arith_p++;
+}
+
+static Arith*arith_assign(void);
+
+static Arith*arith_comma(void)
+{
+        Arith*a=arith_assign();
+
+        arith_space();
+
+        while(a&&*arith_p==',')
+        {
+                arith_p++;
+                a=arith_node(A_COMMA,a,arith_assign());
+                arith_space();
+        }
+
+        return a;
+}
+
+/*
+	primary: NUMBER | BASE#DIGITS | NAME | '(' comma ')'
+*/
+
+static Arith*arith_primary(void)
+{
+        Arith*a;
+        const char*q;
+
+        arith_space();
+
+        if(*arith_p=='(')
+        {
+                arith_p++;
+                a=arith_comma();
+
+                if(*arith_p!=')')
+                        arith_fault("')' expected");
+                else
+                        arith_p++;
+
+                return a;
+        }
+
+        if(isdigit((int)*arith_p))
+        {
+                char*end;
+
+                a=arith_node(A_NUM,NULL,NULL);
+                errno=0;
+                a->val=strtoll(arith_p,&end,0);
+
+                if(*end=='#'&&a->val>=2&&a->val<=36)
+                        a->val=strtoll(end+1,&end,(int)a->val);
+
+                if(errno||isalnum((int)*end)||*end=='_')
+                        arith_fault("invalid number");
+
+                arith_p=end;
+                return a;
+        }
+
+        q=scan_name(arith_p);
+        if(q==arith_p)
+        {
+                arith_fault("operand expected");
+                return arith_node(A_NUM,NULL,NULL);
+        }
+
+        a=arith_node(A_VAR,NULL,NULL);
+        a->name=strndup(arith_p,q-arith_p);
+        if(!a->name)
+                shfail("strndup");
+
+        arith_p=q;
+
+        return a;
+}
+
+/*
+	unary: ('++' | '--') NAME | ('+' | '-' | '!' | '~') unary
+	       | primary ['++' | '--']
+*/
+
+static Arith*arith_unary(void)
+{
+        Arith*a;
+
+        arith_space();
+
+        if((arith_p[0]=='+'||arith_p[0]=='-')&&arith_p[1]==arith_p[0])
+        {
+                const char*q=arith_p+2;
+
+                while(isspace((int)*q))
+                        q++;
+
+                if(scan_name(q)!=q)
+                {
+                        int op=*arith_p=='+'?A_PREINC:A_PREDEC;
+
+                        arith_p=q;
+                        return arith_node(op,arith_primary(),NULL);
+                }
+        }
+
+        switch(*arith_p)
+        {
+                case '+':
+                        arith_p++;
+                        return arith_unary();
+                case '-':
+                        arith_p++;
+                        return arith_node(A_NEG,arith_unary(),NULL);
+                case '!':
+                        arith_p++;
+                        return arith_node(A_NOT,arith_unary(),NULL);
+                case '~':
+                        arith_p++;
+                        return arith_node(A_BNOT,arith_unary(),NULL);
+        }
+
+        a=arith_primary();
+        arith_space();
+
+        if(a->op==A_VAR&&(arith_p[0]=='+'||arith_p[0]=='-')&&arith_p[1]==arith_p[0])
+        {
+                a=arith_node(*arith_p=='+'?A_POSTINC:A_POSTDEC,a,NULL);
+                arith_p+=2;
+        }
+
+        return a;
+}
+
+/*
+	Binary operators, by precedence climbing.  An operator followed by
+	'=' (other than a comparison) is a compound assignment and is left
+	for arith_assign().
+*/
+
+static Arith*arith_binary(int minprec)
+{
+        Arith*a=arith_unary();
+
+        for(;;)
+        {
+                register int i;
+                size_t n=0;
+
+                arith_space();
+
+                for(i=0;arith_ops[i].s;i++)
+                {
+                        n=strlen(arith_ops[i].s);
+
+                        if(!strncmp(arith_p,arith_ops[i].s,n))
+                                break;
+                }
+
+                if(!arith_ops[i].s||arith_ops[i].prec<minprec)
+                        return a;
+
+                if(arith_p[n]=='='&&arith_ops[i].op!=A_EQ&&arith_ops[i].op!=A_NE&&
+                   arith_ops[i].op!=A_LE&&arith_ops[i].op!=A_GE)
+                        return a;
+
+                arith_p+=n;
+                a=arith_node(arith_ops[i].op,a,arith_binary(arith_ops[i].prec+1));
+        }
+}
+
+/*
+	cond: binary ['?' comma ':' cond]
+*/
+
+static Arith*arith_cond(void)
+{
+        Arith*a=arith_binary(1),*c;
+
+        arith_space();
+
+        if(*arith_p!='?')
+                return a;
+
+        arith_p++;
+        c=arith_node(A_COND,arith_comma(),NULL);
+
+        if(*arith_p!=':')
+                arith_fault("':' expected");
+        else
+                arith_p++;
+
+        c->c=a;
+        c->r=arith_cond();
+
+        return c;
+}
+
+/*
+	assign: NAME ('=' | '+=' | ... | '|=') assign | cond
+*/
+
+static Arith*arith_assign(void)
+{
+        static const struct
+        {
+                const char*s;
+                int op;
+        } aops[]=
+        {
+                { "=",0 }, { "+=",A_ADD }, { "-=",A_SUB }, { "*=",A_MUL },
+                { "/=",A_DIV }, { "%=",A_MOD }, { "<<=",A_SHL }, { ">>=",A_SHR },
+                { "&=",A_BAND }, { "^=",A_XOR }, { "|=",A_BOR }, { NULL,0 }
+        };
+        Arith*a=arith_cond();
+        register int i;
+
+        arith_space();
+
+        for(i=0;aops[i].s;i++)
+        {
+                size_t n=strlen(aops[i].s);
+
+                if(!strncmp(arith_p,aops[i].s,n)&&(n>1||arith_p[1]!='='))
+                {
+                        Arith*set;
+
+                        if(a->op!=A_VAR)
+                        {
+                                arith_fault("assignment to non-variable");
+                                return a;
+                        }
+
+                        arith_p+=n;
+                        set=arith_node(A_ASSIGN,a,arith_assign());
+                        set->aop=aops[i].op;
+
+                        return set;
+                }
+        }
+
+        return a;
+}
+
+/*
+	Find the compiled form of an expression, parsing it on first use.
+
+	Postcondition: returns NULL after a syntax error was reported
+*/
+
+static Arith*arith_compile(const char*text)
+{
+        register unsigned int h=2166136261U;
+        register const char*p;
+        Arith_cache*cp;
+        Arith*a;
+
+        for(p=text;*p;p++)
+                h=(h^(unsigned char)*p)*16777619U;
+
+        h%=ARITH_BUCKETS;
+
+        for(cp=arith_cache[h];cp;cp=cp->next)
+                if(!strcmp(cp->text,text))
+                        return cp->tree;
+
+        arith_p=text;
+        arith_error=0;
+        arith_space();
+
+        if(!*arith_p)
+                a=arith_node(A_NUM,NULL,NULL);
+        else
+        {
+                a=arith_comma();
+
+                if(*arith_p&&!arith_error)
+                        arith_fault("syntax error");
+        }
+
+        if(arith_error)
+        {
+                arith_free(a);
+                return NULL;
+        }
+
+        cp=malloc(sizeof *cp);
+        if(!cp)
+                shfail("malloc");
+
+        cp->text=strdup(text);
+        if(!cp->text)
+                shfail("strdup");
+
+        cp->tree=a;
+        cp->next=arith_cache[h];
+        arith_cache[h]=cp;
+        arith_cached++;
+
+        return a;
+}
+
+/*
+	Empty the cache once it is full, as when every pass of a loop
+	builds a different text with $var.  Only safe between
+	evaluations.
+*/
+
+static void arith_flush(void)
+{
+        register unsigned int h;
+
+        for(h=0;h<ARITH_BUCKETS;h++)
+        {
+                Arith_cache*cp,*next;
+
+                for(cp=arith_cache[h];cp;cp=next)
+                {
+                        next=cp->next;
+                        arith_free(cp->tree);
+                        free(cp->text);
+                        free(cp);
+                }
+
+                arith_cache[h]=NULL;
+        }
+
+        arith_cached=0;
+}
+
+static long long arith_eval(Arith*a);
+
+/*
+	The numeric value of a variable.  Unset or empty is 0; anything
+	that is not a plain number is evaluated as an expression.
+*/
+
+static long long arith_var(const char*name)
+{
+        static int depth;
+        char*val=getvar(name,strlen(name)),*end;
+        long long n;
+        Arith*a;
+
+        if(!val||!*val)
+                return 0;
+
+        n=strtoll(val,&end,0);
+        if(!*end&&end!=val)
+                return n;
+
+        if(depth>=32)
+        {
+                shfault("%s: expression recursion level exceeded",name);
+                arith_error=1;
+                return 0;
+        }
+
+        depth++;
+        n=arith_error;
+        a=arith_compile(val);
+        arith_error|=n;
+        n=a?arith_eval(a):(arith_error=1,0);
+        depth--;
+
+        return n;
+}
+
+static long long arith_apply(int op,long long l,long long r)
+{
+        switch(op)
+        {
+                case A_MUL:
+                        return (long long)((unsigned long long)l*(unsigned long long)r);
+                case A_DIV:
+                case A_MOD:
+                        if(!r)
+                        {
+                                shfault("arithmetic: division by zero");
+                                arith_error=1;
+                                return 0;
+                        }
+
+                        if(r==-1)
+                                return op==A_DIV?(long long)(0ULL-(unsigned long long)l):0;
+
+                        return op==A_DIV?l/r:l%r;
+                case A_ADD:
+                        return (long long)((unsigned long long)l+(unsigned long long)r);
+                case A_SUB:
+                        return (long long)((unsigned long long)l-(unsigned long long)r);
+                case A_SHL:
+                        return (long long)((unsigned long long)l<<(r&63));
+                case A_SHR:
+                        return l>>(r&63);
+                case A_LT:
+                        return l<r;
+                case A_LE:
+                        return l<=r;
+                case A_GT:
+                        return l>r;
+                case A_GE:
+                        return l>=r;
+                case A_EQ:
+                        return l==r;
+                case A_NE:
+                        return l!=r;
+                case A_BAND:
+                        return l&r;
+                case A_XOR:
+                        return l^r;
+                case A_BOR:
+                        return l|r;
+        }
+
+        return r;
+}
+
+static long long arith_store(const char*name,long long n)
+{
+        char num[24];
+
+        snprintf(num,sizeof num,"%lld",n);
+        setvar(name,num);
+
+        return n;
+}
+
+/*
+	Evaluate a compiled expression in 64-bit signed arithmetic.
+*/
+
+static long long arith_eval(Arith*a)
+{
+        long long n;
+
+        switch(a->op)
+        {
+                case A_NUM:
+                        return a->val;
+                case A_VAR:
+                        return arith_var(a->name);
+                case A_NEG:
+                        return (long long)(0ULL-(unsigned long long)arith_eval(a->l));
+                case A_NOT:
+                        return !arith_eval(a->l);
+                case A_BNOT:
+                        return ~arith_eval(a->l);
+                case A_PREINC:
+                case A_PREDEC:
+                        n=arith_var(a->l->name)+(a->op==A_PREINC?1:-1);
+                        return arith_store(a->l->name,n);
+                case A_POSTINC:
+                case A_POSTDEC:
+                        n=arith_var(a->l->name);
+                        arith_store(a->l->name,n+(a->op==A_POSTINC?1:-1));
+                        return n;
+                case A_LAND:
+                        return arith_eval(a->l)&&arith_eval(a->r);
+                case A_LOR:
+                        return arith_eval(a->l)||arith_eval(a->r);
+                case A_COND:
+                        return arith_eval(a->c)?arith_eval(a->l):arith_eval(a->r);
+                case A_ASSIGN:
+                        n=arith_eval(a->r);
+
+                        if(a->aop)
+                                n=arith_apply(a->aop,arith_var(a->l->name),n);
+
+                        return arith_store(a->l->name,n);
+                case A_COMMA:
+                        arith_eval(a->l);
+                        return arith_eval(a->r);
+        }
+
+        return arith_apply(a->op,arith_eval(a->l),arith_eval(a->r));
+}
+
+/*
+	Evaluate the text of an arithmetic expression into *np.  Parameter
+	expansion is done on the text first only when it contains a '$'
+	or quotes; plain variable names are looked up at evaluation time,
+	so the text, and its cached tree, stay the same from one pass of
+	a loop to the next.
+
+	Postcondition: returns nonzero, with expand_error set, after an
+	error was reported
+*/
+
+static int arith_text(const char*text,long long*np)
+{
+        char*t=NULL;
+        Arith*a;
+
+        if(strpbrk(text,"$'\"\\"))
+                text=t=expand_string((char*)text);
+
+        if(arith_cached>=ARITH_CACHE_MAX)
+                arith_flush();
+
+        arith_error=0;
+        a=arith_compile(text);
+
+        if(a)
+                *np=arith_eval(a);
+
+        free(t);
+
+        if(!a||arith_error)
+        {
+                expand_error=1;
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+	Substitute an arithmetic expansion $((expression)).
+
+	Precondition: p points at "$(("
+	Postcondition: returns the first character after the closing "))"
+*/
+
+static char*expand_arith(char*p,Strbuf*sb,Vec*fields,int*have)
+{
+        char*q,*text,num[24];
+        int depth=0;
+        long long n;
+
+        for(q=p+3;*q;q++)
+        {
+                if(*q=='(')
+                        depth++;
+                else if(*q==')'&&!depth--)
+                        break;
+        }
+
+        if(q[0]!=')'||q[1]!=')')
+        {
+                shfault("%s: missing '))'",p);
+                expand_error=1;
+                return p+strlen(p);
+        }
+
+        text=strndup(p+3,q-(p+3));
+        if(!text)
+                shfail("strndup");
+
+        if(!arith_text(text,&n))
+        {
+                snprintf(num,sizeof num,"%lld",n);
+                put_value(sb,num,strlen(num),fields,have);
+        }
+
+        free(text);
+
+        return q+2;
+}
+
+/*
+	One or more compiled glob patterns, run side by side as a
+	bit-parallel NFA: bit i of a state set means the elements before
+	i have matched, and the bit after a pattern's last element accepts
+	for it (arm says which pattern that is).  mask holds, for every
+	byte, the elements that byte can satisfy; a '*' satisfies all of
+	them and keeps its bit.
+
+	For case, whose arms are all matched at once, the state sets met
+	are numbered as DFA states as they turn up, with their transitions
+	in dnext, so a subject is matched with one table lookup per byte.
+
+	Patterns are kept in glob_cache by text (with quoted characters
+	backslash-escaped), so a pattern in a loop body is compiled only
+	once.
+*/
+
+typedef unsigned long long Bits;
+
+#define BITS_WORD (8*sizeof(Bits))
+
+typedef struct Glob_def
+{
+        size_t nwords;
+        Bits*mask,*star,*init,*accept;
+        int*arm;
+        Bits*dset;
+        int*dnext,*dmatch;
+        size_t ndfa,dsize;
+} Glob;
+
+#define GLOB_DEAD (-2)
+#define GLOB_DFA_MAX 256
+
+typedef struct Glob_cache_def
+{
+        char*text;
+        size_t len;
+        int reverse;
+        Glob*glob;
+        struct Glob_cache_def*next;
+} Glob_cache;
+
+#define GLOB_BUCKETS 64
+#define GLOB_CACHE_MAX 1024
+
+static Glob_cache*glob_cache[GLOB_BUCKETS];
+static unsigned int glob_cached;
+
+static void glob_free(Glob*g)
+{
+        if(!g)
+                return;
+
+        free(g->mask);
+        free(g->star);
+        free(g->init);
+        free(g->accept);
+        free(g->arm);
+        free(g->dset);
+        free(g->dnext);
+        free(g->dmatch);
+        free(g);
+}
+
+/*
+	Add the bracket expression at p to set.
+
+	Precondition: *p=='['
+	Postcondition: returns the character after the closing ']', or
+	NULL if there is none and the '[' is an ordinary character
+*/
+
+static const char*glob_bracket(const char*p,unsigned char*set)
+{
+        static const struct
+        {
+                const char*name;
+                int(*is)(int);
+        } classes[]=
+        {
+                { "alnum",isalnum }, { "alpha",isalpha }, { "blank",isblank },
+                { "cntrl",iscntrl }, { "digit",isdigit }, { "graph",isgraph },
+                { "lower",islower }, { "print",isprint }, { "punct",ispunct },
+                { "space",isspace }, { "upper",isupper }, { "xdigit",isxdigit },
+                { NULL,NULL }
+        };
+        unsigned char in[256]={0};
+        int negate=0,first=1,c,i;
+
+        if(*++p=='!'||*p=='^')
+        {
+                negate=1;
+                p++;
+        }
+
+        for(;*p&&(*p!=']'||first);first=0)
+        {
+                if(p[0]=='['&&p[1]==':')
+                {
+                        const char*e=strstr(p+2,":]");
+
+                        for(i=0;e&&classes[i].name;i++)
+                                if(strlen(classes[i].name)==(size_t)(e-(p+2))
+                                   &&!strncmp(classes[i].name,p+2,e-(p+2)))
+                                        break;
+
+                        if(e&&classes[i].name)
+                        {
+                                for(c=1;c<256;c++)
+                                        if(classes[i].is(c))
+                                                in[c]=1;
+
+                                p=e+2;
+                                continue;
+                        }
+                }
+
+                if(*p=='\\'&&p[1])
+                        p++;
+
+                c=(unsigned char)*p++;
+
+                if(p[0]=='-'&&p[1]&&p[1]!=']')
+                {
+                        int hi=(unsigned char)p[1]=='\\'&&p[2]?(unsigned char)p[2]:(unsigned char)p[1];
+
+                        p+=p[1]=='\\'&&p[2]?3:2;
+
+                        for(;c<=hi;c++)
+                                in[c]=1;
+                }
+                else
+                        in[c]=1;
+        }
+
+        if(!*p)
+                return NULL;
+
+        for(c=1;c<256;c++)
+                set[c]=in[c]^negate;
+
+        return p+1;
+}
+
+/*
+	Set the bit after each '*' whose own bit is set: a '*' may match
+	nothing.  Runs of '*' are merged when compiling, so one pass is
+	enough.
+*/
+
+static void glob_closure(const Glob*g,Bits*s)
+{
+        register size_t w;
+        Bits carry=0,x;
+
+        for(w=0;w<g->nwords;w++)
+        {
+                x=s[w]&g->star[w];
+                s[w]|=x<<1|carry;
+                carry=x>>(BITS_WORD-1);
+        }
+}
+
+/*
+	Compile the NUL-terminated patterns packed in text[0..len) into one
+	automaton.  A pattern's accepting bit has an empty mask, so no
+	state carries over into the pattern after it.
+*/
+
+static Glob*glob_build(const char*text,size_t len,int reverse)
+{
+        enum { G_ONE, G_STAR, G_ACCEPT };
+        unsigned char(*sets)[256]=NULL;
+        char*kinds=NULL;
+        size_t n=0,size=0,first,i,j;
+        const char*p=text,*end=text+len;
+        int npat=0;
+        Glob*g;
+
+        while(p<end)
+        {
+                for(first=n;;n++)
+                {
+                        if(n==size)
+                        {
+                                size=size?2*size:16;
+                                sets=realloc(sets,size*sizeof *sets);
+                                kinds=realloc(kinds,size);
+                                if(!sets||!kinds)
+                                        shfail("realloc");
+                        }
+
+                        memset(sets[n],0,sizeof sets[n]);
+                        kinds[n]=G_ONE;
+
+                        if(!*p)
+                        {
+                                kinds[n++]=G_ACCEPT;
+                                p++;
+                                break;
+                        }
+
+                        if(*p=='*')
+                        {
+                                p++;
+
+                                if(n>first&&kinds[n-1]==G_STAR)
+                                {
+                                        n--;
+                                        continue;
+                                }
+
+                                kinds[n]=G_STAR;
+                                memset(sets[n],1,sizeof sets[n]);
+                        }
+                        else if(*p=='?')
+                        {
+                                p++;
+                                memset(sets[n],1,sizeof sets[n]);
+                        }
+                        else if(*p=='['&&glob_bracket(p,sets[n]))
+                                p=glob_bracket(p,sets[n]);
+                        else
+                        {
+                                if(*p=='\\'&&p[1])
+                                        p++;
+
+                                sets[n][(unsigned char)*p++]=1;
+                        }
+                }
+
+                if(reverse)
+                        for(i=first,j=n-1;i+1<j;i++,j--)
+                        {
+                                unsigned char t[256];
+                                char k=kinds[i];
+
+                                memcpy(t,sets[i],sizeof t);
+                                memcpy(sets[i],sets[j-1],sizeof t);
+                                memcpy(sets[j-1],t,sizeof t);
+                                kinds[i]=kinds[j-1];
+                                kinds[j-1]=k;
+                        }
+        }
+
+        g=calloc(1,sizeof *g);
+        if(!g)
+                shfail("calloc");
+
+        g->nwords=n/BITS_WORD+1;
+        g->mask=calloc(256*g->nwords,sizeof(Bits));
+        g->star=calloc(g->nwords,sizeof(Bits));
+        g->init=calloc(g->nwords,sizeof(Bits));
+        g->accept=calloc(g->nwords,sizeof(Bits));
+        g->arm=calloc(n+1,sizeof(int));
+        if(!g->mask||!g->star||!g->init||!g->accept||!g->arm)
+                shfail("calloc");
+
+        for(i=0;i<n;i++)
+        {
+                Bits bit=(Bits)1<<i%BITS_WORD;
+
+                if(!i||kinds[i-1]==G_ACCEPT)
+                        g->init[i/BITS_WORD]|=bit;
+
+                if(kinds[i]==G_ACCEPT)
+                {
+                        g->accept[i/BITS_WORD]|=bit;
+                        g->arm[i]=npat++;
+                        continue;
+                }
+
+                if(kinds[i]==G_STAR)
+                        g->star[i/BITS_WORD]|=bit;
+
+                for(j=0;j<256;j++)
+                        if(sets[i][j])
+                                g->mask[j*g->nwords+i/BITS_WORD]|=bit;
+        }
+
+        glob_closure(g,g->init);
+
+        free(sets);
+        free(kinds);
+
+        return g;
+}
+
+/*
+	Find the compiled form of the patterns packed in text[0..len),
+	building it on first use.  A reversed pattern matches reversed
+	text, for suffix searches.  The cache is emptied when full, so a
+	pointer from here is only good until the next call.
+*/
+
+static Glob*glob_compile(const char*text,size_t len,int reverse)
+{
+        register unsigned int h=2166136261U;
+        register size_t i;
+        Glob_cache*cp;
+
+        for(i=0;i<len;i++)
+                h=(h^(unsigned char)text[i])*16777619U;
+
+        h=(h^reverse)%GLOB_BUCKETS;
+
+        for(cp=glob_cache[h];cp;cp=cp->next)
+                if(cp->reverse==reverse&&cp->len==len&&!memcmp(cp->text,text,len))
+                        return cp->glob;
+
+        if(glob_cached>=GLOB_CACHE_MAX)
+        {
+                for(h=0;h<GLOB_BUCKETS;h++)
+                {
+                        Glob_cache*next;
+
+                        for(cp=glob_cache[h];cp;cp=next)
+                        {
+                                next=cp->next;
+                                glob_free(cp->glob);
+                                free(cp->text);
+                                free(cp);
+                        }
+
+                        glob_cache[h]=NULL;
+                }
+
+                glob_cached=0;
+
+                return glob_compile(text,len,reverse);
+        }
+
+        cp=malloc(sizeof *cp);
+        if(!cp)
+                shfail("malloc");
+
+        cp->text=malloc(len+1);
+        if(!cp->text)
+                shfail("malloc");
+
+        memcpy(cp->text,text,len);
+        cp->len=len;
+        cp->reverse=reverse;
+        cp->glob=glob_build(text,len,reverse);
+        cp->next=glob_cache[h];
+        glob_cache[h]=cp;
+        glob_cached++;
+
+        return cp->glob;
+}
+
+/*
+	Advance state set s over byte c.
+
+	Postcondition: returns 0 once no state is left, so no longer
+	input can match
+*/
+
+static int glob_step(const Glob*g,Bits*s,unsigned char c)
+{
+        register size_t w;
+        const Bits*m=g->mask+c*g->nwords;
+        Bits carry=0,t,live=0;
+
+        for(w=0;w<g->nwords;w++)
+        {
+                t=s[w]&m[w];
+                s[w]=t<<1|carry|(t&g->star[w]);
+                carry=t>>(BITS_WORD-1);
+        }
+
+        glob_closure(g,s);
+
+        for(w=0;w<g->nwords;w++)
+                live|=s[w];
+
+        return live!=0;
+}
+
+/*
+	The first pattern that state set s accepts for, or -1.
+*/
+
+static int glob_first(const Glob*g,const Bits*s)
+{
+        register size_t w;
+
+        for(w=0;w<g->nwords;w++)
+                if(s[w]&g->accept[w])
+                {
+                        Bits x=s[w]&g->accept[w];
+                        size_t b=w*BITS_WORD;
+
+                        for(;!(x&1);x>>=1)
+                                b++;
+
+                        return g->arm[b];
+                }
+
+        return -1;
+}
+
+/*
+	Match g against the leading bytes of s in one pass, or the
+	trailing bytes read backwards if g was compiled reversed.
+
+	Postcondition: returns the length of the shortest (or longest)
+	match, or -1 if there is none
+*/
+
+static long glob_prefix(const Glob*g,const char*s,size_t n,int reverse,int longest)
+{
+        Bits state[8],*st=g->nwords<=8?state:malloc(g->nwords*sizeof(Bits));
+        long found=-1;
+        size_t i=0;
+
+        if(!st)
+                shfail("malloc");
+
+        memcpy(st,g->init,g->nwords*sizeof(Bits));
+
+        for(;;)
+        {
+                if(glob_first(g,st)>=0)
+                {
+                        found=i;
+
+                        if(!longest)
+                                break;
+                }
+
+                if(i==n||!glob_step(g,st,(unsigned char)s[reverse?n-1-i:i]))
+                        break;
+
+                i++;
+        }
+
+        if(st!=state)
+                free(st);
+
+        return found;
+}
+
+static void expand_part(char*w,Strbuf*sb,Vec*fields,int*have,int quote);
+
+/*
+	Number state set s as a DFA state, adding it if it is new.
+
+	Postcondition: returns -1 if the DFA has grown to GLOB_DFA_MAX
+	states
+*/
+
+static int glob_dstate(Glob*g,const Bits*s)
+{
+        size_t w=g->nwords,i;
+        Bits live=0;
+
+        for(i=0;i<g->ndfa;i++)
+                if(!memcmp(g->dset+i*w,s,w*sizeof(Bits)))
+                        return i;
+
+        if(g->ndfa==GLOB_DFA_MAX)
+                return -1;
+
+        if(g->ndfa==g->dsize)
+        {
+                g->dsize=g->dsize?2*g->dsize:8;
+                g->dset=realloc(g->dset,g->dsize*w*sizeof(Bits));
+                g->dnext=realloc(g->dnext,g->dsize*256*sizeof(int));
+                g->dmatch=realloc(g->dmatch,g->dsize*sizeof(int));
+                if(!g->dset||!g->dnext||!g->dmatch)
+                        shfail("realloc");
+        }
+
+        memcpy(g->dset+g->ndfa*w,s,w*sizeof(Bits));
+
+        for(i=0;i<256;i++)
+                g->dnext[g->ndfa*256+i]=-1;
+
+        for(i=0;i<w;i++)
+                live|=s[i];
+
+        g->dmatch[g->ndfa]=live?glob_first(g,s):GLOB_DEAD;
+
+        return g->ndfa++;
+}
+
+/*
+	Match all of s against every pattern of g in one pass.  Should the
+	DFA fill up, the rest of s is run on the NFA instead.
+
+	Postcondition: returns the index of the first pattern that
+	matches, or -1
+*/
+
+static int glob_which(Glob*g,const char*s,size_t n)
+{
+        int st,t,which;
+        size_t i;
+
+        if(!g->ndfa)
+                glob_dstate(g,g->init);
+
+        for(st=0,i=0;i<n&&g->dmatch[st]!=GLOB_DEAD;st=t,i++)
+        {
+                t=g->dnext[st*256+(unsigned char)s[i]];
+
+                if(t<0)
+                {
+                        Bits state[8],*x=g->nwords<=8?state:malloc(g->nwords*sizeof(Bits));
+
+                        if(!x)
+                                shfail("malloc");
+
+                        memcpy(x,g->dset+st*g->nwords,g->nwords*sizeof(Bits));
+                        glob_step(g,x,(unsigned char)s[i]);
+                        t=glob_dstate(g,x);
+
+                        if(t<0)
+                        {
+                                while(++i<n&&glob_step(g,x,(unsigned char)s[i]))
+                                        ;
+
+                                which=i<n?-1:glob_first(g,x);
+
+                                if(x!=state)
+                                        free(x);
+
+                                return which;
+                        }
+
+                        if(x!=state)
+                                free(x);
+
+                        g->dnext[st*256+(unsigned char)s[i]]=t;
+                }
+        }
+
+        return g->dmatch[st]<0?-1:g->dmatch[st];
+}
+
+/*
+	Expand an operand of ${...} to a single string, as a pattern when
+	glob is set.
+
+	Postcondition: the result is malloc()ed
+*/
+
+static char*expand_operand(char*w,int glob)
+{
+        int saved=expand_glob;
+        char*s;
+
+        expand_glob=glob;
+        s=expand_string(w);
+        expand_glob=saved;
+
+        return s;
+}
+
+/*
+	${NAME:-word} and the other default-value forms; c is the
+	operator character.  With colon set an empty value counts as
+	unset.
+*/
+
+static void param_default(char*name,size_t n,char*val,int c,int colon,char*word,
+                          Strbuf*sb,Vec*fields,int*have)
+{
+        int unset=!val||(colon&&!*val),quoted=expand_quoted;
+        char*s;
+
+        if(unset==(c=='+'))
+        {
+                if(val)
+                        put_value(sb,val,strlen(val),fields,have);
+
+                return;
+        }
+
+        switch(c)
+        {
+        case '-':
+        case '+':
+                expand_part(word,sb,fields,have,quoted?'"':0);
+                break;
+        case '=':
+                if(*name=='?')
+                {
+                        shfault("$%.*s: cannot assign in this way",(int)n,name);
+                        expand_error=1;
+                        break;
+                }
+
+                s=expand_operand(word,0);
+                name=strndup(name,n);
+                if(!name)
+                        shfail("strndup");
+
+                setvar(name,s);
+                free(name);
+                expand_quoted=quoted;
+                put_value(sb,s,strlen(s),fields,have);
+                free(s);
+                break;
+        case '?':
+                s=expand_operand(word,0);
+                shfault("%.*s: %s",(int)n,name,*s?s:"parameter null or not set");
+                expand_error=1;
+                free(s);
+                break;
+        }
+}
+
+/*
+	${NAME#pattern}, ${NAME%pattern} and their longest-match forms.
+	What is left is a slice of the value, put without a copy.
+*/
+
+static void param_trim(char*val,int suffix,int longest,char*word,
+                       Strbuf*sb,Vec*fields,int*have)
+{
+        int quoted=expand_quoted;
+        size_t len=strlen(val);
+        char*pat=expand_operand(word,1);
+        long m=glob_prefix(glob_compile(pat,strlen(pat)+1,suffix),val,len,suffix,longest);
+
+        free(pat);
+
+        if(m<0)
+                m=0;
+
+        expand_quoted=quoted;
+        put_value(sb,suffix?val:val+m,len-m,fields,have);
+}
+
+/*
+	${NAME/pattern/string}: replace the first longest match, every
+	match with "//", or a match anchored at the start with "/#" or
+	at the end with "/%".
+
+	Precondition: word follows the first '/'
+*/
+
+static void param_replace(char*val,char*word,Strbuf*sb,Vec*fields,int*have)
+{
+        int mode=0,quoted=expand_quoted;
+        size_t len=strlen(val),i,last=0;
+        char*p,*pat,*with;
+        Glob*g;
+        long m;
+
+        if(*word=='/'||*word=='#'||*word=='%')
+                mode=*word++;
+
+        for(p=word;*p&&*p!='/';p++)
+                if(*p=='\\'&&p[1])
+                        p++;
+                else if(*p=='\''||*p=='"')
+                {
+                        char q=*p;
+
+                        while(p[1]&&*++p!=q)
+                                if(q=='"'&&*p=='\\'&&p[1])
+                                        p++;
+                }
+
+        with=expand_operand(*p?p+1:p,0);
+        *p=0;
+        pat=expand_operand(word,1);
+        g=glob_compile(pat,strlen(pat)+1,mode=='%');
+        free(pat);
+
+        expand_quoted=quoted;
+
+        if(mode=='#'||mode=='%')
+        {
+                m=glob_prefix(g,val,len,mode=='%',1);
+
+                if(m<0)
+                        put_value(sb,val,len,fields,have);
+                else if(mode=='#')
+                {
+                        put_value(sb,with,strlen(with),fields,have);
+                        put_value(sb,val+m,len-m,fields,have);
+                }
+                else
+                {
+                        put_value(sb,val,len-m,fields,have);
+                        put_value(sb,with,strlen(with),fields,have);
+                }
+
+                free(with);
+                return;
+        }
+
+        for(i=0;i<len;)
+        {
+                m=glob_prefix(g,val+i,len-i,0,1);
+
+                if(m<=0)
+                {
+                        i++;
+                        continue;
+                }
+
+                put_value(sb,val+last,i-last,fields,have);
+                put_value(sb,with,strlen(with),fields,have);
+                last=i+=m;
+
+                if(mode!='/')
+                        break;
+        }
+
+        put_value(sb,val+last,len-last,fields,have);
+        free(with);
+}
+
+/*
+	${NAME:offset} and ${NAME:offset:length}, both arithmetic.  A
+	negative offset counts from the end, as does a negative length.
+*/
+
+static void param_substr(char*val,char*word,Strbuf*sb,Vec*fields,int*have)
+{
+        long long off=0,n,len=strlen(val);
+        int quoted=expand_quoted;
+        char*colon=strchr(word,':');
+
+        if(colon)
+                *colon=0;
+
+        if(arith_text(word,&off))
+                return;
+
+        if(off<0)
+                off+=len;
+
+        if(off<0||off>len)
+                off=len;
+
+        n=len-off;
+
+        if(colon&&arith_text(colon+1,&n))
+                return;
+
+        if(n<0)
+        {
+                n+=len-off;
+
+                if(n<0)
+                {
+                        shfault("%s: substring expression < 0",colon+1);
+                        expand_error=1;
+                        return;
+                }
+        }
+
+        if(n>len-off)
+                n=len-off;
+
+        expand_quoted=quoted;
+        put_value(sb,val+off,n,fields,have);
+}
+
+/*
+	Substitute ${...}: a plain reference, ${#NAME}, or a name followed
+	by an operator:
+
+	:-  -  :=  =  :+  +  :?  ?  default, assign, alternative, error
+	#  ##  %  %%                remove a prefix or suffix pattern
+	/  //  /#  /%               replace a pattern
+	:offset  :offset:length     substring
+
+	Precondition: p points at "${"
+	Postcondition: returns the first character after the closing '}'
+*/
+
+static char*expand_brace(char*p,Strbuf*sb,Vec*fields,int*have)
+{
+        char*end=bracket_end(p+1),*name=p+2,*op,*val,*word,num[24];
+        int length=0;
+
+        if(!end)
+        {
+                shfault("%s: bad substitution",p);
+                expand_error=1;
+                return p+strlen(p);
+        }
+
+        if(*name=='#'&&name+1<end)
+        {
+                length=1;
+                name++;
+        }
+
+        if(*name=='?')
+        {
+                snprintf(num,sizeof num,"%d",last_status);
+                val=num;
+                op=name+1;
+        }
+        else
+        {
+                op=(char*)scan_name(name);
+                val=op==name?NULL:getvar(name,op-name);
+        }
+
+        if(op==name||(length&&op!=end)||(op<end&&!strchr(":-=+?#%/",*op)))
+        {
+                shfault("%.*s: bad substitution",(int)(end+1-p),p);
+                expand_error=1;
+                return end+1;
+        }
+
+        if(length)
+        {
+                snprintf(num,sizeof num,"%zu",val?strlen(val):0);
+                put_value(sb,num,strlen(num),fields,have);
+                return end+1;
+        }
+
+        if(op==end)
+        {
+                if(val)
+                        put_value(sb,val,strlen(val),fields,have);
+
+                return end+1;
+        }
+
+        if(*op==':'&&op[1]&&strchr("-=+?",op[1]))
+                word=op+2;
+        else if(op[0]==op[1]&&(*op=='#'||*op=='%'))
+                word=op+2;
+        else
+                word=op+1;
+
+        word=strndup(word,end-word);
+        if(!word)
+                shfail("strndup");
+
+        if(*op==':'&&op[1]&&strchr("-=+?",op[1]))
+                param_default(name,op-name,val,op[1],1,word,sb,fields,have);
+        else if(strchr("-=+?",*op))
+                param_default(name,op-name,val,*op,0,word,sb,fields,have);
+        else if(!val)
+                ;
+        else if(*op==':')
+                param_substr(val,word,sb,fields,have);
+        else if(*op=='/')
+                param_replace(val,word,sb,fields,have);
+        else
+                param_trim(val,*op=='%',op[1]==*op,word,sb,fields,have);
+
+        free(word);
+
+        return end+1;
+}
+
+/*
+	Substitute the parameter reference ($?, $NAME or ${...}), the
+	arithmetic expansion or the command substitution at p.
+
+	Precondition: *p=='$'
+	Postcondition: returns the first character after the reference
+*/
+
+static char*expand_param(char*p,Strbuf*sb,Vec*fields,int*have)
+{
+        char*name,*val,num[12];
+
+        if(p[1]=='('&&p[2]=='(')
+                return expand_arith(p,sb,fields,have);
+
+        if(p[1]=='(')
+                return expand_command(p,sb,fields,have);
+
+        if(p[1]=='{')
+                return expand_brace(p,sb,fields,have);
+
+        name=++p;
+
+        if(*p=='?')
+        {
+                snprintf(num,sizeof num,"%d",last_status);
+                val=num;
+                p++;
+        }
+        else if(scan_name(p)!=p)
+        {
+                p=(char*)scan_name(p);
+                val=getvar(name,p-name);
+        }
+        else
+        {
+                sb_putc(sb,'$');
+                *have=1;
+
+                return name;
+        }
+
+        if(val)
+                put_value(sb,val,strlen(val),fields,have);
+
+        return p;
+}
+
+/*
+	Expand w onto the word being built in sb, starting inside double
+	quotes if quote=='"'.  Unquoted whitespace, which only an operand
+	of ${...} can hold, separates fields.
+*/
+
+static void expand_part(char*w,Strbuf*sb,Vec*fields,int*have,int quote)
+{
+        register char*p=w;
+        int quoted=expand_quoted;
+
+        while(*p)
+        {
+                if(quote=='\'')
+                {
+                        if(*p=='\'')
+                                quote=0;
+                        else
+                                sb_putq(sb,*p);
+
+                        p++;
+                }
+                else if(*p=='\\')
+                {
+                        if(quote&&!strchr("$`\"\\",p[1]))
+                                sb_putq(sb,'\\');
+
+                        if(*++p)
+                                sb_putq(sb,*p++);
+
+                        *have=1;
+                }
+                else if(*p=='\''&&!quote)
+                {
+                        quote='\'';
+                        *have=1;
+                        p++;
+                }
+                else if(*p=='"')
+                {
+                        quote=quote?0:'"';
+                        *have=1;
+                        p++;
+                }
+                else if(*p=='$')
+                {
+                        expand_quoted=quote!=0;
+                        p=expand_param(p,sb,quote?NULL:fields,have);
+                }
+                else if(!quote&&fields&&isspace((int)(unsigned char)*p))
+                        put_value(sb,p++,1,fields,have);
+                else if(!quote&&p==w&&(*p=='<'||*p=='>')&&p[1]=='(')
+                {
+                        p=expand_procsubst(p,sb,fields,have);
+                        *have=1;
+                }
+                else
+                {
+                        if(quote)
+                                sb_putq(sb,*p++);
+                        else
+                                sb_putc(sb,*p++);
+
+                        *have=1;
+                }
+        }
+
+        expand_quoted=quoted;
+}
+
+/*
+	Expand a raw word as it is about to be used: substitute $? and
+	variables and remove quotes.  With fields!=NULL the result is
+	appended to that vector as zero or more fields; otherwise it is
+	left in sb as one string.
+*/
+
+static void expand(char*w,Strbuf*sb,Vec*fields)
+{
+        int have=0;
+
+        expand_part(w,sb,fields,&have,0);
+
+        if(fields&&(have||sb->len))
+                vec_push(fields,sb_take(sb));
+}
+
+/*
+	Expand a word that must stay a single string, such as the target
+	of a redirection.
+
+	Postcondition: the result is malloc()ed
+*/
+
+static char*expand_string(char*w)
+{
+        Strbuf sb={0};
+
+        expand(w,&sb,NULL);
+
+        return sb_take(&sb);
+}
+
+/*
+	Expand the body of a here-document: parameters and arithmetic are
+	substituted and a backslash quotes only $, ` and itself, or joins
+	lines.  Quotes are ordinary characters.
+
+	Postcondition: the result is malloc()ed
+*/
+
+static char*expand_heredoc(char*p)
+{
+        Strbuf sb={0};
+        int have=0,quoted=expand_quoted;
+
+        while(*p)
+        {
+                if(*p=='\\'&&p[1]&&strchr("$`\\\n",p[1]))
+                {
+                        if(p[1]!='\n')
+                                sb_putc(&sb,p[1]);
+
+                        p+=2;
+                }
+                else if(*p=='$')
+                {
+                        expand_quoted=1;
+                        p=expand_param(p,&sb,NULL,&have);
+                }
+                else
+                        sb_putc(&sb,*p++);
+        }
+
+        expand_quoted=quoted;
+
+        return sb_take(&sb);
+}
+
+/*
+	Put the text of a here-document or here-string in a sealed memfd,
+	positioned at its start.  It is read as a file: there is no
+	temporary file, no writer process and no pipe buffer to fill.
+
+	Postcondition: returns -1, with errno set, on failure
+*/
+
+static int here_fd(const char*text,int newline)
+{
+        size_t len=strlen(text),off;
+        ssize_t n;
+        int fd=memfd_create("here-document",MFD_CLOEXEC|MFD_ALLOW_SEALING);
+
+        if(fd<0)
+                return -1;
+
+        for(off=0;off<len+newline;off+=n)
+        {
+                n=off<len?write(fd,text+off,len-off):write(fd,"\n",1);
+
+                if(n<0)
+                {
+                        int e=errno;
+
+                        if(e==EINTR)
+                        {
+                                n=0;
+                                continue;
+                        }
+
+                        close(fd);
+                        errno=e;
+
+                        return -1;
+                }
+        }
+
+        fcntl(fd,F_ADD_SEALS,F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+        lseek(fd,0,SEEK_SET);
+
+        return fd;
+}
+
+/*
+	How many redirections in effect name each of the descriptors 0-9,
+	which close_stray_fds() must then leave to the command.
+*/
+
+static unsigned char redirected[10];
+
+/*
+	Perform the redirections of a command.  A child calls this between
+	fork() and exec; builtins run in the shell itself, so for them the
+	displaced descriptors are parked in saved[] (close-on-exec, above
+	the 0-9 range a redirection can name) for unredirect().
+
+	Postcondition: returns 0, or -1 after a fault has been reported
+*/
+
+static int redirect(Redir*rp,int*saved)
+{
+        for(;rp;rp=rp->next)
+        {
+                char*word;
+                int fd;
+
+                if(!saved)
+                        redirected[rp->fd]++;
+                else if(saved[rp->fd]==-2)
+                {
+                        saved[rp->fd]=fcntl(rp->fd,F_DUPFD_CLOEXEC,10);
+                        redirected[rp->fd]++;
+                }
+
+                expand_error=0;
+
+                if(rp->type==REDIR_HERELIT)
+                        word=NULL;
+                else if(rp->type==REDIR_HERE)
+                        word=expand_heredoc(rp->word);
+                else
+                        word=expand_string(rp->word);
+
+                if(expand_error)
+                {
+                        free(word);
+                        return -1;
+                }
+
+                switch(rp->type)
+                {
+                        case REDIR_IN:
+                                fd=open(word,O_RDONLY|O_CLOEXEC);
+                                break;
+                        case REDIR_OUT:
+                                fd=open(word,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0666);
+                                break;
+                        case REDIR_APPEND:
+                                fd=open(word,O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0666);
+                                break;
+                        case REDIR_HERE:
+                        case REDIR_HERELIT:
+                        case REDIR_HERESTR:
+                                fd=here_fd(word?word:rp->word,rp->type==REDIR_HERESTR);
+                                break;
+                        default:
+                                if(!strcmp(word,"-"))
+                                {
+                                        close(rp->fd);
+                                        free(word);
+                                        continue;
+                                }
+
+                                if(!isdigit((int)*word)||word[1])
+                                {
+                                        shfault("%s: bad file descriptor",word);
+                                        free(word);
+                                        return -1;
+                                }
+
+                                fd=*word-'0';
+                                if(fd!=rp->fd&&dup2(fd,rp->fd)<0)
+                                {
+                                        shfault("%s: %s",word,strerror(errno));
+                                        free(word);
+                                        return -1;
+                                }
+
+                                free(word);
+                                continue;
+                }
+
+                if(fd<0)
+                {
+                        shfault("%s: %s",rp->type>=REDIR_HERE?"here-document":word,strerror(errno));
+                        free(word);
+                        return -1;
+                }
+
+                free(word);
+
+                /* dup2() leaves the new descriptor without FD_CLOEXEC. */
+                if(fd!=rp->fd)
+                {
+                        if(dup2(fd,rp->fd)<0)
+                                shfail("dup2");
+
+                        close(fd);
+                }
+                else
+                        fcntl(fd,F_SETFD,0);
+        }
+
+        return 0;
+}
+
+/*
+	Undo redirect() for a builtin run in the shell process.
+
+	Precondition: saved was filled by redirect()
+*/
+
+static void unredirect(int*saved)
+{
+        register int fd;
+
+        for(fd=0;fd<10;fd++)
+        {
+                if(saved[fd]==-2)
+                        continue;
+
+                redirected[fd]--;
+
+                if(saved[fd]<0)
+                        close(fd);
+                else
+                {
+                        dup2(saved[fd],fd);
+                        close(saved[fd]);
+                }
+        }
+}
+
+/*
+	Drop every descriptor from lowfd upward in a child about to exec.
+	close_range() does it in one system call, so the cost of exec does
+	not grow with the number of descriptors the shell holds open.
+*/
+
+static void close_fd_range(unsigned int lowfd,unsigned int highfd)
+{
+        long fd,max;
+
+#ifdef SYS_close_range
+        if(!syscall(SYS_close_range,lowfd,highfd,0))
+                return;
+#endif
+
+        max=sysconf(_SC_OPEN_MAX);
+        for(fd=lowfd;fd<max&&fd<=(long)highfd;fd++)
+                close((int)fd);
+}
+
+/*
+	The shell's ends of the pipes of process substitutions, and their
+	children, from expand_procsubst() until the command using them is
+	done.
+*/
+
+typedef struct Procsubst_def
+{
+        int fd;
+        pid_t pid;
+} Procsubst;
+
+static Procsubst*procsubst;
+static size_t nprocsubst,procsubst_size;
+
+/*
+	Close every descriptor from lowfd up except those a redirection in
+	effect has set up, and those of pending process substitutions,
+	which the command is to open by their /dev/fd names and so must
+	inherit.
+*/
+
+static void close_stray_fds(unsigned int lowfd)
+{
+        size_t i;
+        unsigned int keep,fd;
+
+        for(;;)
+        {
+                for(keep=~0U,i=0;i<nprocsubst;i++)
+                        if((unsigned int)procsubst[i].fd>=lowfd&&(unsigned int)procsubst[i].fd<keep)
+                                keep=procsubst[i].fd;
+
+                for(fd=lowfd;fd<10&&fd<keep;fd++)
+                        if(redirected[fd])
+                                keep=fd;
+
+                if(keep==~0U)
+                        break;
+
+                if(keep>lowfd)
+                        close_fd_range(lowfd,keep-1);
+
+                fcntl(keep,F_SETFD,0);
+                lowfd=keep+1;
+        }
+
+        close_fd_range(lowfd,~0U);
+
+        /* The epoll set went with the rest; a new one may not close
+           whatever now has its number. */
+        if(event_fd>=(int)lowfd)
+        {
+                event_fd=-1;
+                nwatched=0;
+        }
+}
+
+static int builtin_timeout(char**argv);
+static int builtin_with(char**argv);
+
+/*
+	Map a command name onto the function implementing it, if the
+	command is internal to the shell.
+*/
+
+static Builtin lookup_builtin(char*name)
+{
+        if(!name)
+                return NULL;
+
+        /* The following sequence of if-else statements corresponds to 
+           commands which are internal to the shell. */
+        if(!strcmp(name,":")||!strcmp(name,"true"))
+                return builtin_true;
+        else if(!strcmp(name,"[")||!strcmp(name,"test"))
+                return builtin_test;
+        else if(!strcmp(name,"break"))
+                return builtin_break;
+        else if(!strcmp(name,"copy"))
+                return builtin_copy;
+        else if(!strcmp(name,"continue"))
+                return builtin_continue;
+        else if(!strcmp(name,"echo"))
+                return builtin_echo;
+        else if(!strcmp(name,"exit"))
+                return builtin_exit;
+        else if(!strcmp(name,"false"))
+                return builtin_false;
+        else if(!strcmp(name,"help"))
+                return builtin_help;
+        else if(!strcmp(name,"history"))
+                return builtin_history;
+        else if(!strcmp(name,"jobs"))
+                return builtin_jobs;
+        else if(!strcmp(name,"meter"))
+                return builtin_meter;
+        else if(!strcmp(name,"printf"))
+                return builtin_printf;
+        else if(!strcmp(name,"read"))
+                return builtin_read;
+        else if(!strcmp(name,"set"))
+                return builtin_set;
+        else if(!strcmp(name,"tee"))
+                return builtin_tee;
+        else if(!strcmp(name,"timeout"))
+                return builtin_timeout;
+        else if(!strcmp(name,"wait"))
+                return builtin_wait;
+        else if(!strcmp(name,"with"))
+                return builtin_with;
+
+        return NULL;
+}
+
+/*
+	Tokens recognised by lex().  Words keep their quotes; those are
+	removed by expand() each time the word is used.
+*/
+
+enum { T_WORD, T_AND, T_OR, T_SEMI, T_DSEMI, T_AMP, T_PIPE, T_LPAREN, T_RPAREN,
+       T_REDIR, T_NL, T_EOF, T_ERROR };
+
+typedef struct Token_def
+{
+        int type;
+        char*text;
+        size_t start;
+        int fd,rtype,strip;
+} Token;
+
+/*
+	The source text of the command being parsed.  It grows by a line
+	at a time while a compound command is still open, so the lexer
+	keeps offsets into it rather than pointers.
+*/
+
+static Strbuf src;
+static size_t lexpos;
+static Token tok;
+static int parse_error,nesting;
+
+/*
+	The shell's input.  It is read through a buffer of its own, so the
+	shell can tell when none is left over: input_pos and input_len
+	bound what has been read but not yet taken.
+*/
+
+static int input_fd=-1;
+static char input_buf[BUFSIZ];
+static size_t input_pos,input_len;
+static int interactive;
+
+/*
+	Read a line of input into line, as fgets() would: up to and
+	including a newline, or size-1 bytes, NUL-terminated.
+
+	Postcondition: returns NULL at end of input
+*/
+
+static char*read_line(char*line,size_t size)
+{
+        size_t n=0;
+
+        if(input_fd<0)
+                return NULL;
+
+        while(n+1<size)
+        {
+                size_t take;
+                char*nl;
+
+                if(input_pos==input_len)
+                {
+                        ssize_t got=read(input_fd,input_buf,sizeof input_buf);
+
+                        if(got<0&&errno==EINTR)
+                                continue;
+
+                        if(got<=0)
+                                break;
+
+                        input_pos=0;
+                        input_len=got;
+                }
+
+                take=input_len-input_pos;
+                if(take>size-1-n)
+                        take=size-1-n;
+
+                if((nl=memchr(input_buf+input_pos,'\n',take)))
+                        take=nl-(input_buf+input_pos)+1;
+
+                memcpy(line+n,input_buf+input_pos,take);
+                input_pos+=take;
+                n+=take;
+
+                if(nl)
+                        break;
+        }
+
+        if(!n)
+                return NULL;
+
+        line[n]='\0';
+
+        return line;
+}
+
+/*
+	Fetch another line of a command that is not complete yet.
+
+	Postcondition: returns 0 at end of input
+*/
+
+static int read_more(void)
+{
+        char line[BUFSIZ];
+
+        if(input_fd<0)
+                return 0;
+
+        if(interactive)
+        {
+                fputs("> ",stdout);
+                fflush(stdout);
+        }
+
+        if(!read_line(line,sizeof line))
+                return 0;
+
+        sb_putn(&src,line,strlen(line));
+
+        return 1;
+}
+
+/*
+	Find the end of a raw word, stepping over quotes, backslash
+	escapes and $( ... ) substitutions.
+
+	Postcondition: returns NULL on an unterminated quote or $(
+*/
+
+static char*scan_word(char*p)
+{
+        char*start=p;
+
+        while(*p&&(!strchr(" \t\r\n\v\f;&|<>()",*p)||(p==start&&p[1]=='('&&(*p=='<'||*p=='>'))))
+        {
+                if(*p=='\\')
+                {
+                        if(*++p)
+                                p++;
+                }
+                else if(p==start&&(*p=='<'||*p=='>'))
+                {
+                        p=bracket_end(p+1);
+                        if(!p++)
+                                return NULL;
+                }
+                else if(*p=='$'&&(p[1]=='{'||p[1]=='('))
+                {
+                        p=bracket_end(p+1);
+                        if(!p++)
+                                return NULL;
+                }
+                else if(*p=='\''||*p=='"')
+                {
+                        char q=*p++;
+
+                        while(*p&&*p!=q)
+                        {
+                                if(q=='"'&&*p=='\\'&&p[1])
+                                        p++;
+                                else if(q=='"'&&*p=='$'&&(p[1]=='{'||p[1]=='('))
+                                {
+                                        p=bracket_end(p+1);
+                                        if(!p)
+                                                return NULL;
+                                }
+
+                                p++;
+                        }
+
+                        if(!*p)
+                                return NULL;
+
+                        p++;
+                }
+                else
+                        p++;
+        }
+
+        return p;
+}
+
+/*
+	Recognise a redirection operator such as <, >, >>, 2>, 2>&
+	or <&.  Its operand is the word lexed after it.
+
+	Precondition: p points at the operator (or its descriptor digit)
+	Postcondition: returns the first character after the operator
+*/
+
+static char*lex_redir(char*p)
+{
+        tok.type=T_REDIR;
+        tok.fd=-1;
+
+        if(isdigit((int)*p))
+                tok.fd=*p++-'0';
+
+        if(*p++=='<')
+        {
+                tok.rtype=REDIR_IN;
+
+                if(tok.fd<0)
+                        tok.fd=STDIN_FILENO;
+
+                if(p[0]=='<'&&p[1]=='<')
+                {
+                        tok.rtype=REDIR_HERESTR;
+                        return p+2;
+                }
+
+                if(*p=='<')
+                {
+                        tok.rtype=REDIR_HERE;
+                        tok.strip=p[1]=='-';
+                        return p+1+tok.strip;
+                }
+        }
+        else
+        {
+                tok.rtype=REDIR_OUT;
+
+                if(tok.fd<0)
+                        tok.fd=STDOUT_FILENO;
+
+                if(*p=='>')
+                {
+                        tok.rtype=REDIR_APPEND;
+                        return ++p;
+                }
+        }
+
+        if(*p=='&')
+        {
+                tok.rtype=REDIR_DUP;
+                p++;
+        }
+
+        return p;
+}
+
+/*
+	Here-documents whose bodies are still to be read, from the line
+	after the one holding their redirections.
+*/
+
+typedef struct Heredoc_def
+{
+        Redir*rp;
+        int strip;
+} Heredoc;
+
+static Heredoc*heredocs;
+static size_t nheredocs,heredocs_size;
+
+/*
+	Read the bodies of the pending here-documents, leaving lexpos
+	after the last delimiter line.  A quoted delimiter makes the body
+	literal; <<- strips leading tabs.
+*/
+
+static void read_heredocs(void)
+{
+        size_t i;
+
+        for(i=0;i<nheredocs;i++)
+        {
+                Redir*rp=heredocs[i].rp;
+                Strbuf body={0},delim={0};
+                register char*p;
+
+                for(p=rp->word;*p;p++)
+                        if(*p=='\\'&&p[1])
+                                sb_putc(&delim,*++p);
+                        else if(*p!='\''&&*p!='"')
+                                sb_putc(&delim,*p);
+
+                rp->type=strpbrk(rp->word,"'\"\\")?REDIR_HERELIT:REDIR_HERE;
+                sb_putn(&delim,"",0);
+
+                for(;;)
+                {
+                        char*line,*nl;
+                        size_t n;
+
+                        while(!memchr(src.s+lexpos,'\n',src.len-lexpos)&&read_more())
+                                ;
+
+                        if(lexpos==src.len)
+                        {
+                                shfault("here-document ended by end of file (wanted '%s')",delim.s);
+                                break;
+                        }
+
+                        line=src.s+lexpos;
+                        nl=memchr(line,'\n',src.len-lexpos);
+                        n=nl?(size_t)(nl-line):src.len-lexpos;
+                        lexpos+=n+(nl!=NULL);
+
+                        if(heredocs[i].strip)
+                                for(;n&&*line=='\t';n--)
+                                        line++;
+
+                        if(n==delim.len&&!memcmp(line,delim.s,n))
+                                break;
+
+                        sb_putn(&body,line,n);
+                        sb_putc(&body,'\n');
+                }
+
+                free(rp->word);
+                free(delim.s);
+                rp->word=sb_take(&body);
+        }
+
+        nheredocs=0;
+}
+
+/*
+	Read the next token of src into tok.  Inside an unfinished
+	compound command the end of the text pulls in another line.
+*/
+
+static void lex(void)
+{
+        register char*p,*end;
+
+        for(;;)
+        {
+                p=src.s+lexpos;
+                p+=strspn(p," \t\r\v\f");
+
+                if(*p=='#')
+                        p+=strcspn(p,"\n");
+
+                lexpos=p-src.s;
+
+                if(*p||!nesting||!read_more())
+                        break;
+        }
+
+        p=src.s+lexpos;
+        tok.start=lexpos;
+        tok.text=NULL;
+
+        switch(*p)
+        {
+                case '\0':
+                        tok.type=T_EOF;
+                        break;
+                case '\n':
+                        tok.type=T_NL;
+                        p++;
+                        break;
+                case ';':
+                        tok.type=p[1]==';'?T_DSEMI:T_SEMI;
+                        p+=tok.type==T_DSEMI?2:1;
+                        break;
+                case '(':
+                        tok.type=T_LPAREN;
+                        p++;
+                        break;
+                case ')':
+                        tok.type=T_RPAREN;
+                        p++;
+                        break;
+                case '&':
+                        tok.type=p[1]=='&'?T_AND:T_AMP;
+                        p+=tok.type==T_AND?2:1;
+                        break;
+                case '|':
+                        tok.type=p[1]=='|'?T_OR:T_PIPE;
+                        p+=tok.type==T_OR?2:1;
+                        break;
+                default:
+                        if(((*p=='<'||*p=='>')&&p[1]!='(')||(isdigit((int)*p)&&(p[1]=='<'||p[1]=='>')))
+                        {
+                                p=lex_redir(p);
+                                break;
+                        }
+
+                        /* A quote or substitution may go on for more lines. */
+                        while(!(end=scan_word(p))&&read_more())
+                                p=src.s+tok.start;
+
+                        if(!end)
+                        {
+                                tok.type=T_ERROR;
+                                p+=strlen(p);
+                                break;
+                        }
+
+                        tok.type=T_WORD;
+                        tok.text=strndup(p,end-p);
+                        if(!tok.text)
+                                shfail("strndup");
+
+                        p=end;
+        }
+
+        lexpos=p-src.s;
+
+        if(nheredocs&&(tok.type==T_NL||tok.type==T_EOF))
+                read_heredocs();
+}
+
+/*
+	Is the current token the given (reserved) word?
+*/
+
+static int is_word(const char*w)
+{
+        return tok.type==T_WORD&&!strcmp(tok.text,w);
+}
+
+/*
+	Reserved words that close a compound list.
+*/
+
+static int is_terminator(void)
+{
+        return is_word("then")||is_word("elif")||is_word("else")||
+               is_word("fi")||is_word("do")||is_word("done")||
+               is_word("esac")||tok.type==T_DSEMI;
+}
+
+/*
+	Report an unexpected token, once per parse.
+*/
+
+static void syntax_error(void)
+{
+        if(!parse_error)
+        {
+                if(tok.type==T_ERROR)
+                        shfault("syntax error: unterminated quote or $(");
+                else if(tok.type==T_EOF||tok.type==T_NL)
+                        shfault("syntax error: unexpected end of %s",nesting?"file":"line");
+                else
+                        shfault("syntax error near: '%.*s'",(int)(lexpos-tok.start),src.s+tok.start);
+        }
+
+        parse_error=1;
+}
+
+/*
+	Consume the expected reserved word, or report a syntax error.
+*/
+
+static int expect(const char*w)
+{
+        if(!is_word(w))
+        {
+                syntax_error();
+                return 0;
+        }
+
+        free(tok.text);
+        lex();
+
+        return 1;
+}
+
+/*
+	Copy the source text from start up to the current token, for
+	history and job listings.
+*/
+
+static char*source_text(size_t start)
+{
+        char*end=src.s+tok.start,*s;
+
+        while(end>src.s+start&&isspace((int)end[-1]))
+                end--;
+
+        s=strndup(src.s+start,end-(src.s+start));
+        if(!s)
+                shfail("strndup");
+
+        return s;
+}
+
+/*
+	Is the raw word a NAME=value assignment?
+*/
+
+static int is_assignment(const char*w)
+{
+        const char*p=scan_name(w);
+
+        return p!=w&&*p=='=';
+}
+
+/*
+	Parse one redirection, operator and operand, onto *rpp.
+
+	Precondition: tok.type==T_REDIR
+	Postcondition: returns the link for the next Redir, or NULL
+		       after a syntax error
+*/
+
+static Redir**parse_redir(Redir**rpp)
+{
+        Redir*rp=calloc(1,sizeof *rp);
+        int strip;
+
+        if(!rp)
+                shfail("calloc");
+
+        rp->fd=tok.fd;
+        rp->type=tok.rtype;
+        strip=tok.strip;
+
+        lex();
+        if(tok.type!=T_WORD)
+        {
+                free(rp);
+                syntax_error();
+                return NULL;
+        }
+
+        rp->word=tok.text;
+        *rpp=rp;
+
+        if(rp->type==REDIR_HERE)
+        {
+                if(nheredocs==heredocs_size)
+                {
+                        heredocs_size=heredocs_size?2*heredocs_size:4;
+                        heredocs=realloc(heredocs,heredocs_size*sizeof *heredocs);
+                        if(!heredocs)
+                                shfail("realloc");
+                }
+
+                heredocs[nheredocs].rp=rp;
+                heredocs[nheredocs++].strip=strip;
+        }
+
+        lex();
+
+        return &rp->next;
+}
+
+/*
+	simple_command: (ASSIGNMENT)* (WORD | REDIR WORD)*
+*/
+
+static Input*parse_simple(void)
+{
+        Vec words={0},assigns={0};
+        Input*ip;
+        Redir**rpp;
+        size_t start=tok.start;
+
+        ip=calloc(1,sizeof *ip);
+        if(!ip)
+                shfail("calloc");
+
+        rpp=&ip->redirs;
+
+        for(;;)
+        {
+                if(tok.type==T_WORD)
+                {
+                        if(!words.n&&is_assignment(tok.text))
+                                vec_push(&assigns,tok.text);
+                        else
+                                vec_push(&words,tok.text);
+
+                        lex();
+                }
+                else if(tok.type==T_REDIR)
+                {
+                        rpp=parse_redir(rpp);
+                        if(!rpp)
+                                return NULL;
+                }
+                else
+                        break;
+        }
+
+        if(!words.n&&!assigns.n&&!ip->redirs)
+        {
+                syntax_error();
+                return NULL;
+        }
+
+        if(!words.v)
+                vec_push(&words,NULL);
+
+        ip->kind=IN_SIMPLE;
+        ip->cmdvec=words.v;
+        ip->assigns=assigns.v;
+        ip->cmdbuf=source_text(start);
+        ip->internal=lookup_builtin(*ip->cmdvec);
+
+        return ip;
+}
+
+static Input*parse_list(void);
+
+/*
+	A compound list: a list closed by a reserved word rather than by
+	the end of the line.  It may not be empty.
+*/
+
+static Input*parse_compound_list(void)
+{
+        Input*ip=parse_list();
+
+        if(!ip&&!parse_error)
+                syntax_error();
+
+        return ip;
+}
+
+/*
+	if_clause: 'if' list 'then' list ('elif' list 'then' list)*
+		   ['else' list] 'fi'
+
+	Each elif becomes a nested IN_IF hung from elsepart; an else
+	part is an IN_LIST there.
+*/
+
+static Input*parse_if(void)
+{
+        Input*ip=calloc(1,sizeof *ip);
+
+        if(!ip)
+                shfail("calloc");
+
+        ip->kind=IN_IF;
+
+        free(tok.text);
+        lex();
+
+        if(!(ip->cond=parse_compound_list())||!expect("then")||
+           !(ip->body=parse_compound_list()))
+                return NULL;
+
+        if(is_word("elif"))
+        {
+                ip->elsepart=parse_if();
+                return ip->elsepart?ip:NULL;
+        }
+
+        if(is_word("else"))
+        {
+                free(tok.text);
+                lex();
+
+                ip->elsepart=calloc(1,sizeof *ip->elsepart);
+                if(!ip->elsepart)
+                        shfail("calloc");
+
+                ip->elsepart->kind=IN_LIST;
+
+                if(!(ip->elsepart->body=parse_compound_list()))
+                        return NULL;
+        }
+
+        return expect("fi")?ip:NULL;
+}
+
+/*
+	while_clause: ('while' | 'until') list 'do' list 'done'
+*/
+
+static Input*parse_while(void)
+{
+        Input*ip=calloc(1,sizeof *ip);
+
+        if(!ip)
+                shfail("calloc");
+
+        ip->kind=IN_WHILE;
+        ip->until=is_word("until");
+
+        free(tok.text);
+        lex();
+
+        if(!(ip->cond=parse_compound_list())||!expect("do")||
+           !(ip->body=parse_compound_list())||!expect("done"))
+                return NULL;
+
+        return ip;
+}
+
+/*
+	for_clause: 'for' NAME [NL*] ['in' WORD* (';' | NL)] NL* 'do'
+		    list 'done'
+
+	The words after 'in' are kept raw in cmdvec and expanded each
+	time the loop is entered.
+*/
+
+static Input*parse_for(void)
+{
+        Vec words={0};
+        Input*ip=calloc(1,sizeof *ip);
+
+        if(!ip)
+                shfail("calloc");
+
+        ip->kind=IN_FOR;
+
+        free(tok.text);
+        lex();
+
+        if(tok.type!=T_WORD||*scan_name(tok.text)||!*tok.text)
+        {
+                syntax_error();
+                return NULL;
+        }
+
+        ip->name=tok.text;
+        lex();
+
+        while(tok.type==T_NL)
+                lex();
+
+        if(is_word("in"))
+        {
+                free(tok.text);
+                lex();
+
+                while(tok.type==T_WORD)
+                {
+                        vec_push(&words,tok.text);
+                        lex();
+                }
+
+                if(tok.type!=T_SEMI&&tok.type!=T_NL)
+                {
+                        syntax_error();
+                        return NULL;
+                }
+
+                lex();
+        }
+        else if(tok.type==T_SEMI)
+                lex();
+
+        while(tok.type==T_NL)
+                lex();
+
+        if(!words.v)
+                vec_push(&words,NULL);
+
+        ip->cmdvec=words.v;
+
+        if(!expect("do")||!(ip->body=parse_compound_list())||!expect("done"))
+                return NULL;
+
+        return ip;
+}
+
+/*
+	case word in [(]pattern[|pattern]...) list ;; ... esac
+
+	The ;; after the last arm may be left out.
+*/
+
+static Input*parse_case(void)
+{
+        Input*ip=calloc(1,sizeof *ip),**app;
+
+        if(!ip)
+                shfail("calloc");
+
+        ip->kind=IN_CASE;
+        app=&ip->body;
+
+        free(tok.text);
+        lex();
+
+        if(tok.type!=T_WORD)
+        {
+                syntax_error();
+                return NULL;
+        }
+
+        ip->name=tok.text;
+        lex();
+
+        while(tok.type==T_NL)
+                lex();
+
+        if(!expect("in"))
+                return NULL;
+
+        for(;;)
+        {
+                Vec patterns={0};
+                Input*arm;
+
+                while(tok.type==T_NL)
+                        lex();
+
+                if(is_word("esac"))
+                        break;
+
+                if(tok.type==T_LPAREN)
+                        lex();
+
+                for(;;)
+                {
+                        if(tok.type!=T_WORD)
+                        {
+                                syntax_error();
+                                return NULL;
+                        }
+
+                        if(strpbrk(tok.text,"$`"))
+                                ip->dynamic=1;
+
+                        vec_push(&patterns,tok.text);
+                        lex();
+
+                        if(tok.type!=T_PIPE)
+                                break;
+
+                        lex();
+                }
+
+                if(tok.type!=T_RPAREN)
+                {
+                        syntax_error();
+                        return NULL;
+                }
+
+                lex();
+
+                arm=calloc(1,sizeof *arm);
+                if(!arm)
+                        shfail("calloc");
+
+                arm->kind=IN_LIST;
+                arm->cmdvec=patterns.v;
+                *app=arm;
+                app=&arm->link;
+
+                while(tok.type==T_NL)
+                        lex();
+
+                if(tok.type!=T_DSEMI&&!is_word("esac")&&!(arm->body=parse_compound_list()))
+                        return NULL;
+
+                if(tok.type==T_DSEMI)
+                        lex();
+                else if(!is_word("esac"))
+                {
+                        syntax_error();
+                        return NULL;
+                }
+        }
+
+        if(!expect("esac"))
+                return NULL;
+
+        return ip;
+}
+
+/*
+	command: if_clause | while_clause | for_clause | simple_command
+
+	A compound command may be followed by redirections that apply to
+	all of it.
+*/
+
+static Input*parse_command(void)
+{
+        Input*ip;
+        Redir**rpp;
+
+        if(is_word("if"))
+                ip=parse_if();
+        else if(is_word("while")||is_word("until"))
+                ip=parse_while();
+        else if(is_word("for"))
+                ip=parse_for();
+        else if(is_word("case"))
+                ip=parse_case();
+        else
+                return parse_simple();
+
+        if(!ip)
+                return NULL;
+
+        for(rpp=&ip->redirs;tok.type==T_REDIR;)
+                if(!(rpp=parse_redir(rpp)))
+                        return NULL;
+
+        return ip;
+}
+
+/*
+	Parse a compound command with the lexer allowed to read further
+	lines until it is closed.
+*/
+
+static Input*parse_nested(void)
+{
+        Input*ip;
+        int compound=is_word("if")||is_word("while")||is_word("until")||
+                     is_word("for")||is_word("case");
+
+        nesting+=compound;
+        ip=parse_command();
+        nesting-=compound;
+
+        return ip;
+}
+
+/*
+	A pipeline: commands joined by '|', each of which may be followed
+	by newlines.
+*/
+
+static Input*parse_pipeline(void)
+{
+        size_t start=tok.start;
+        Input*ip=parse_nested(),*pipeline,**spp;
+
+        if(!ip||tok.type!=T_PIPE)
+                return ip;
+
+        pipeline=calloc(1,sizeof *pipeline);
+        if(!pipeline)
+                shfail("calloc");
+
+        pipeline->kind=IN_PIPE;
+        pipeline->body=ip;
+        spp=&ip->link;
+
+        while(tok.type==T_PIPE)
+        {
+                nesting++;
+                do lex(); while(tok.type==T_NL);
+                nesting--;
+
+                *spp=parse_nested();
+                if(!*spp)
+                        return NULL;
+
+                spp=&(*spp)->link;
+        }
+
+        pipeline->cmdbuf=source_text(start);
+
+        return pipeline;
+}
+
+/*
+	and_or: command (('&&' | '||') NL* command)*
+*/
+
+static Input*parse_andor(void)
+{
+        Input*head,*ip,*tail;
+
+        head=ip=parse_pipeline();
+
+        while(ip&&(tok.type==T_AND||tok.type==T_OR))
+        {
+                int op=tok.type==T_AND?OP_AND:OP_OR;
+
+                nesting++;
+                do lex(); while(tok.type==T_NL);
+                nesting--;
+
+                for(tail=ip;tail->link;tail=tail->link);
+
+                tail->link=parse_pipeline();
+                ip=tail->link;
+
+                if(ip)
+                        ip->op=op;
+        }
+
+        return ip?head:NULL;
+}
+
+/*
+	list: and_or ((';' | '&' | NL) and_or)* [';' | '&']
+
+	The and-or lists are chained one after another, up to the end of
+	the text or a reserved word that closes an enclosing compound
+	command.  One that is to run in the background as a whole is
+	wrapped in an IN_LIST so a single child can run it.
+*/
+
+static Input*parse_list(void)
+{
+        Input*head=NULL,**ipp=&head;
+
+        while(tok.type!=T_EOF&&!is_terminator())
+        {
+                size_t start=tok.start;
+                Input*ip;
+
+                if(tok.type==T_NL)
+                {
+                        lex();
+                        continue;
+                }
+
+                ip=parse_andor();
+                if(!ip)
+                        return NULL;
+
+                if(tok.type==T_AMP)
+                {
+                        if(ip->link)
+                        {
+                                Input*wrap=calloc(1,sizeof *wrap);
+
+                                if(!wrap)
+                                        shfail("calloc");
+
+                                wrap->kind=IN_LIST;
+                                wrap->body=ip;
+                                ip=wrap;
+                        }
+
+                        lex();
+                        ip->cmdbuf=source_text(start);
+                        ip->background=1;
+                }
+                else if(tok.type==T_SEMI||tok.type==T_NL)
+                        lex();
+                else if(tok.type!=T_EOF&&!is_terminator())
+                {
+                        syntax_error();
+                        return NULL;
+                }
+
+                while(*ipp)
+                        ipp=&(*ipp)->link;
+
+                *ipp=ip;
+        }
+
+        return head;
+}
+
+/*
+	Parse user-provided command line input, reading on from
+	the input while a compound command is left open.
+
+ 	Precondition: in!=NULL
+	Postcondition: 
+		if((i=parse_inbuf))
+		{
+			i->next=NULL;
+			i->kind==IN_LIST;
+			i->body!=NULL;
+
+			i->cmdbuf==the source text less surrounding whitespace;
+		}
+*/
+	
+
+static Input*parse_inbuf(char*in)
+{
+        register char*p=in;
+        Input*ret=NULL;
+
+        parse_error=0;
+
+        ret=calloc(1,sizeof *ret);
+        if(!ret)
+                shfail("calloc");
+
+	/* Deal with history reference, if any. */
+        p+=strspn(p," \t\r\n\v\f");
+
+	if(*p=='!')
+	{
+		char*exc=p;
+		unsigned long hr;
+
+		p=++exc;
+		p+=strcspn(exc," \t\r\n\v\f");
+		*p='\0';
+
+		hr=strtoul(exc,NULL,10);
+		if(!hr)
+		{
+			perror("strtoul");
+			free(ret);
+			ret=NULL;
+		}
+		else
+		{
+			register unsigned int cnt=0;
+			Input*hp;
+
+			for(hp=histlist;hp;hp=hp->next)
+				if(++cnt==hr)
+					break;
+
+			if(cnt!=hr)
+			{
+				shfault("!%lu: event not found",hr);
+				parse_error=1;
+				return NULL;
+			}
+
+			memcpy(ret,hp,sizeof *ret);
+			ret->next=NULL;
+			ret->historical=1;
+		}
+
+		return ret;
+	}
+
+        src.len=0;
+        sb_putn(&src,p,strlen(p));
+        lexpos=0;
+        nesting=0;
+        nheredocs=0;
+        lex();
+
+        ret->kind=IN_LIST;
+        ret->body=parse_list();
+
+        if(ret->body&&tok.type!=T_EOF)
+                syntax_error();
+
+        ret->cmdbuf=source_text(0);
+
+        if(!ret->body||parse_error)
+        {
+                free(ret);
+                return NULL;
+        }
+
+        return ret;
+}
+
+/*
+	Convert a waitpid() status into a shell exit status.
+*/
+
+static int exit_status(int stat_loc)
+{
+        if(WIFSIGNALED(stat_loc))
+                return 128+WTERMSIG(stat_loc);
+
+        return WEXITSTATUS(stat_loc);
+}
+
+/*
+	The exit status of a job, which is that of timeout, 124 or 137,
+	if its time limit ran out.
+*/
+
+static int job_status(Job*jp,int stat_loc)
+{
+        if(jp->signalled)
+                return jp->signalled>1?137:124;
+
+        return exit_status(stat_loc);
+}
+
+/*
+	Read a small file, such as one under /sys, into buf.
+
+	Postcondition: returns 0, or -1
+*/
+
+static int read_file(const char*path,char*buf,size_t size)
+{
+        ssize_t n;
+        int fd=open(path,O_RDONLY|O_CLOEXEC);
+
+        if(fd<0)
+                return -1;
+
+        n=read(fd,buf,size-1);
+        close(fd);
+
+        if(n<0)
+                return -1;
+
+        buf[n]='\0';
+
+        return 0;
+}
+
+static long cpu_topology(int cpu,const char*name)
+{
+        char path[128],buf[32];
+
+        snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/topology/%s",cpu,name);
+
+        return read_file(path,buf,sizeof buf)?-1:strtol(buf,NULL,10);
+}
+
+/*
+	Whether JOB_PLACE, a list of placement policies, names policy.
+*/
+
+static int place_policy(const char*policy)
+{
+        char*p=getenv("JOB_PLACE");
+        size_t len=strlen(policy);
+
+        while(p&&*p)
+        {
+                size_t n=strcspn(p,", ");
+
+                if(n==len&&!strncmp(p,policy,len))
+                        return 1;
+
+                p+=n;
+                p+=strspn(p,", ");
+        }
+
+        return 0;
+}
+
+static int parse_cpus(char*p,cpu_set_t*set);
+
+/*
+	CPU placement.  place_all are the CPUs the shell may use, and
+	place_cpus those background jobs may be pinned to: all but the
+	first, which is left to the shell and the foreground.  place_load
+	counts the jobs pinned to each CPU.  place_core tells which
+	physical core each CPU is a thread of, and place_thread which
+	thread of it.  place_llc names the last-level cache each shares,
+	by the lowest CPU sharing it, whose place_level is that cache's
+	level and place_domain_load the pipelines placed there.
+*/
+
+static cpu_set_t place_all,place_cpus;
+static int place_ready,place_count,place_nall;
+static unsigned int place_load[CPU_SETSIZE];
+static long place_core[CPU_SETSIZE];
+static int place_thread[CPU_SETSIZE],place_llc[CPU_SETSIZE],place_level[CPU_SETSIZE];
+static unsigned int place_domain_load[CPU_SETSIZE];
+
+/*
+	Find the last-level cache of cpu in sysfs: the highest level of
+	data or unified cache, and the CPUs sharing it.
+*/
+
+static void place_cache(int cpu)
+{
+        char path[128],buf[256];
+        cpu_set_t shared;
+        int index,level,best=0,low;
+
+        place_llc[cpu]=-1;
+
+        for(index=0;;index++)
+        {
+                snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/cache/index%d/level",cpu,index);
+
+                if(read_file(path,buf,sizeof buf))
+                        break;
+
+                level=atoi(buf);
+                snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/cache/index%d/type",cpu,index);
+
+                if(level<=best||read_file(path,buf,sizeof buf)||!strncmp(buf,"Instruction",11))
+                        continue;
+
+                snprintf(path,sizeof path,"/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",cpu,index);
+
+                if(read_file(path,buf,sizeof buf))
+                        continue;
+
+                buf[strcspn(buf,"\n")]='\0';
+
+                if(parse_cpus(buf,&shared))
+                        continue;
+
+                for(low=0;low<CPU_SETSIZE&&!CPU_ISSET(low,&shared);low++)
+                        ;
+
+                best=level;
+                place_llc[cpu]=low;
+        }
+
+        if(place_llc[cpu]>=0)
+                place_level[place_llc[cpu]]=best;
+}
+
+static int place_init(void)
+{
+        int cpu,other,first=-1;
+        long package,core;
+
+        if(place_ready)
+                return place_count;
+
+        place_ready=1;
+
+        if(sched_getaffinity(0,sizeof place_all,&place_all))
+                return 0;
+
+        place_cpus=place_all;
+
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+        {
+                if(!CPU_ISSET(cpu,&place_all))
+                        continue;
+
+                package=cpu_topology(cpu,"physical_package_id");
+                core=cpu_topology(cpu,"core_id");
+                place_core[cpu]=package<0||core<0?-1-cpu:package<<16|core;
+                place_cache(cpu);
+                place_nall++;
+
+                for(other=0;other<cpu;other++)
+                        if(CPU_ISSET(other,&place_all)&&place_core[other]==place_core[cpu])
+                                place_thread[cpu]++;
+
+                if(first<0)
+                {
+                        first=cpu;
+                        CPU_CLR(cpu,&place_cpus);
+                }
+                else
+                        place_count++;
+        }
+
+        /* Without cache information, all is one domain. */
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                if(CPU_ISSET(cpu,&place_all)&&(place_llc[cpu]<0||!CPU_ISSET(place_llc[cpu],&place_all)))
+                        place_llc[cpu]=first;
+
+        return place_count;
+}
+
+/*
+	NUMA nodes, from /sys/devices/system/node.  node_cpus are the CPUs
+	of each node the shell may use and node_load the jobs bound to
+	it; node_of is the node of each CPU.  node_count counts the nodes
+	with CPUs: with fewer than two there is nothing to place.
+*/
+
+#define NODE_MAX CPU_SETSIZE
+
+#ifndef MPOL_BIND
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#endif
+
+static cpu_set_t node_cpus[NODE_MAX];
+static int node_of[CPU_SETSIZE];
+static unsigned int node_load[NODE_MAX];
+static int node_ready,node_count,node_next;
+
+static int node_init(void)
+{
+        char path[64],buf[1024];
+        cpu_set_t online,cpus;
+        int node,cpu;
+
+        if(node_ready)
+                return node_count;
+
+        node_ready=1;
+        place_init();
+
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                node_of[cpu]=-1;
+
+        /* Node numbers are listed as CPU numbers are. */
+        if(read_file("/sys/devices/system/node/online",buf,sizeof buf))
+                return 0;
+
+        buf[strcspn(buf,"\n")]='\0';
+
+        if(parse_cpus(buf,&online))
+                return 0;
+
+        for(node=0;node<NODE_MAX;node++)
+        {
+                if(!CPU_ISSET(node,&online))
+                        continue;
+
+                snprintf(path,sizeof path,"/sys/devices/system/node/node%d/cpulist",node);
+
+                if(read_file(path,buf,sizeof buf))
+                        continue;
+
+                buf[strcspn(buf,"\n")]='\0';
+
+                if(!*buf||parse_cpus(buf,&cpus))
+                        continue;
+
+                for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                        if(CPU_ISSET(cpu,&cpus))
+                                node_of[cpu]=node;
+
+                CPU_AND(&node_cpus[node],&cpus,&place_all);
+
+                if(CPU_COUNT(&node_cpus[node]))
+                        node_count++;
+        }
+
+        return node_count;
+}
+
+/*
+	The node a CPU belongs to, or -1 if that is not known.
+*/
+
+static int node_of_cpu(int cpu)
+{
+        node_init();
+
+        return cpu>=0&&cpu<CPU_SETSIZE?node_of[cpu]:-1;
+}
+
+/*
+	The node with the fewest jobs bound to it, for the numa policy,
+	taking the nodes in turn when several have as few.
+
+	Postcondition: returns -1 if that policy is off, or there is only
+	one node
+*/
+
+static int node_pick(void)
+{
+        int i,node,best=-1;
+
+        if(!place_policy("numa")||node_init()<2)
+                return -1;
+
+        for(i=0;i<NODE_MAX;i++)
+        {
+                node=(node_next+i)%NODE_MAX;
+
+                if(CPU_COUNT(&node_cpus[node])&&(best<0||node_load[node]<node_load[best]))
+                        best=node;
+        }
+
+        node_next=best+1;
+
+        return best;
+}
+
+/*
+	Bind the calling process to node: run it on the node's CPUs, but
+	for the one kept for the shell if there are others, and take its
+	memory from the node alone.
+*/
+
+static int node_bind(int node)
+{
+        unsigned long mask[NODE_MAX/(8*sizeof(unsigned long))];
+        cpu_set_t set;
+
+        CPU_AND(&set,&node_cpus[node],&place_cpus);
+
+        if(!CPU_COUNT(&set))
+                set=node_cpus[node];
+
+        if(sched_setaffinity(0,sizeof set,&set))
+                return -1;
+
+        memset(mask,0,sizeof mask);
+        mask[node/(8*sizeof *mask)]|=1UL<<node%(8*sizeof *mask);
+
+        /* The kernel counts one bit fewer than maxnode. */
+        return syscall(SYS_set_mempolicy,MPOL_BIND,mask,(unsigned long)NODE_MAX+1);
+}
+
+/*
+	The CPU with the fewest jobs pinned to it, and of those, the one
+	whose core has the fewest, so that jobs take whole cores before
+	they share one between hyperthreads.  If node is not -1, only
+	the node's CPUs are taken.
+
+	Postcondition: returns -1 if placement is off
+*/
+
+static int place_pick(int node)
+{
+        unsigned int best_load=~0U,best_core=~0U;
+        int cpu,other,best=-1;
+
+        if(!place_policy("spread")||!place_init())
+                return -1;
+
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+        {
+                unsigned int core=0;
+
+                if(!CPU_ISSET(cpu,&place_cpus)||place_load[cpu]>best_load
+                   ||(node>=0&&node_of[cpu]!=node))
+                        continue;
+
+                for(other=0;other<CPU_SETSIZE;other++)
+                        if(CPU_ISSET(other,&place_cpus)&&place_core[other]==place_core[cpu])
+                                core+=place_load[other];
+
+                if(place_load[cpu]<best_load||core<best_core)
+                {
+                        best=cpu;
+                        best_load=place_load[cpu];
+                        best_core=core;
+                }
+        }
+
+        return best;
+}
+
+static int pin_cpu(pid_t pid,int cpu)
+{
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu,&set);
+
+        return sched_setaffinity(pid,sizeof set,&set);
+}
+
+/*
+	Apply fn to every thread of the running process pid and of the
+	processes it has forked, as /proc lists them, so that a change
+	made to a job reaches all of it.  A task gone meanwhile is passed
+	over.
+
+	Postcondition: returns what fn returned for pid itself
+*/
+
+static int job_tasks(pid_t pid,int(*fn)(pid_t,void*),void*arg)
+{
+        char path[64],buf[4096],*p,*end;
+        struct dirent*de;
+        int ret=fn(pid,arg);
+        DIR*dir;
+
+        snprintf(path,sizeof path,"/proc/%d/task",(int)pid);
+
+        if(!(dir=opendir(path)))
+                return ret;
+
+        while((de=readdir(dir)))
+        {
+                pid_t tid=(pid_t)strtol(de->d_name,&end,10),child;
+
+                if(*end||tid<=0)
+                        continue;
+
+                if(tid!=pid)
+                        fn(tid,arg);
+
+                snprintf(path,sizeof path,"/proc/%d/task/%d/children",(int)pid,(int)tid);
+
+                if(read_file(path,buf,sizeof buf))
+                        continue;
+
+                for(p=buf;(child=(pid_t)strtol(p,&end,10))>0;p=end)
+                        job_tasks(child,fn,arg);
+        }
+
+        closedir(dir);
+
+        return ret;
+}
+
+static int pin_task(pid_t tid,void*set)
+{
+        return sched_setaffinity(tid,sizeof(cpu_set_t),set);
+}
+
+/*
+	The cache domain with the fewest pipelines placed in it, for the
+	cache policy, in node if that is not -1.
+
+	Postcondition: returns -1 if that policy is off
+*/
+
+static int place_domain_pick(int node)
+{
+        int cpu,best=-1;
+
+        if(!place_policy("cache"))
+                return -1;
+
+        place_init();
+
+        if(place_nall<2)
+                return -1;
+
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                if(CPU_ISSET(cpu,&place_all)&&place_llc[cpu]==cpu&&(node<0||node_of[cpu]==node)
+                   &&(best<0||place_domain_load[cpu]<place_domain_load[best]))
+                        best=cpu;
+
+        return best;
+}
+
+/*
+	The CPU for stage i of a pipeline in a cache domain: the domain's
+	CPUs in turn, first threads of every core before second threads.
+*/
+
+static int place_stage_cpu(int domain,int i)
+{
+        int order[CPU_SETSIZE],n=0,thread,cpu,more=1;
+
+        for(thread=0;more;thread++)
+        {
+                more=0;
+
+                for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                        if(CPU_ISSET(cpu,&place_all)&&place_llc[cpu]==domain)
+                        {
+                                if(place_thread[cpu]==thread)
+                                        order[n++]=cpu;
+                                else if(place_thread[cpu]>thread)
+                                        more=1;
+                        }
+        }
+
+        return n?order[i%n]:domain;
+}
+
+/*
+	Write the CPUs of a cache domain out as a list such as 0-3,6.
+*/
+
+static void format_domain(char*buf,size_t size,int domain)
+{
+        int cpu,low=-1;
+        size_t len=0;
+
+        *buf='\0';
+
+        for(cpu=0;cpu<=CPU_SETSIZE&&len<size;cpu++)
+        {
+                int in=cpu<CPU_SETSIZE&&CPU_ISSET(cpu,&place_all)&&place_llc[cpu]==domain;
+
+                if(in&&low<0)
+                        low=cpu;
+                else if(!in&&low>=0)
+                {
+                        len+=snprintf(buf+len,size-len,low==cpu-1?"%s%d":"%s%d-%d",len?",":"",low,cpu-1);
+                        low=-1;
+                }
+        }
+}
+
+/*
+	A placed job has finished: free its node, cache domain or CPU,
+	and move a job to the CPU from the busiest of its node if that
+	leaves the two more even.
+*/
+
+static void place_release(Job*jp)
+{
+        int cpu,busiest=-1,freed=jp->cpu,node=jp->node;
+        cpu_set_t set;
+        Job*other;
+
+        if(node>=0)
+                node_load[node]--;
+
+        jp->node=-1;
+
+        if(jp->domain>=0)
+                place_domain_load[jp->domain]--;
+
+        jp->domain=-1;
+
+        if(freed<0)
+                return;
+
+        place_load[freed]--;
+        jp->cpu=-1;
+
+        for(cpu=0;cpu<CPU_SETSIZE;cpu++)
+                if(CPU_ISSET(cpu,&place_cpus)&&(node<0||node_of[cpu]==node)
+                   &&(busiest<0||place_load[cpu]>place_load[busiest]))
+                        busiest=cpu;
+
+        if(busiest<0||place_load[busiest]<place_load[freed]+2)
+                return;
+
+        CPU_ZERO(&set);
+        CPU_SET(freed,&set);
+
+        /* Every thread and child of the job moves, or the load counted
+           for the two CPUs would be wrong. */
+        for(other=joblist;other;other=other->next)
+                if(other->cpu==busiest&&(other->node<0||other->node==node)
+                   &&!job_tasks(other->pid,pin_task,&set))
+                {
+                        other->cpu=freed;
+                        place_load[busiest]--;
+                        place_load[freed]++;
+                        break;
+                }
+}
+
+/*
+	Record a background command in the job list, under the number
+	after the highest in use.  fd, rp and lines describe its output
+	pipe, if any; see job_capture().  A positive secs limits its run
+	time; see job_timer().  gate, if not -1, holds it back; see
+	pressure_high().
+*/
+
+static Job*add_job(pid_t pid,char*cmdbuf,int fd,Ring*rp,int lines,double secs,double grace,int gate)
+{
+        unsigned int id=0,i;
+        Job*jptr,**jpp;
+
+        for(jptr=donelist;jptr;jptr=jptr->next)
+                if(jptr->id>id)
+                        id=jptr->id;
+
+        for(jpp=&joblist;*jpp;jpp=&(*jpp)->next)
+                if((*jpp)->id>id)
+                        id=(*jpp)->id;
+
+        jptr=malloc(sizeof *jptr);
+        if(!jptr)
+                shfail("malloc");
+
+        jptr->pid=pid;
+        jptr->id=id+1;
+        jptr->fd=fd;
+        jptr->ring=*rp;
+        memset(&jptr->partial,0,sizeof jptr->partial);
+        jptr->lines=lines;
+        jptr->timer=-1;
+        jptr->grace=grace;
+        jptr->limit=secs;
+        jptr->gate=gate;
+        jptr->signalled=0;
+        jptr->yielded=0;
+        jptr->statfd=jptr->iofd=-1;
+        jptr->ticks=0;
+        jptr->sampled=0;
+        jptr->cpu=jptr->domain=jptr->node=-1;
+        jptr->next=NULL;
+        jptr->cmdbuf=cmdbuf;
+        *jpp=jptr;
+
+        /* %N now means this job, not one reaped before it. */
+        for(i=nreaped;i-->0;)
+                if(reaped[i].id==jptr->id)
+                        reaped_drop(i);
+        printf("Begin\tpid: %d job: %u argv: %s\n",(int)pid,jptr->id,jptr->cmdbuf);
+
+        if(fd>=0&&event_watch(fd,jptr,EVENT_OUTPUT))
+        {
+                close(fd);
+                jptr->fd=-1;
+        }
+
+        if(gate>=0)
+                throttle_hold(jptr);
+        else if(secs>0)
+                job_timer(jptr,secs,grace);
+
+        return jptr;
+}
+
+static void free_job(Job*jp)
+{
+        if(jp->fd>=0)
+                event_close(jp->fd);
+
+        ring_free(&jp->ring);
+        free(jp->partial.s);
+        free(jp);
+}
+
+/*
+	Keep a finished job that captured output, forgetting the oldest
+	beyond JOB_DONE_KEEP.
+*/
+
+static void keep_done_job(Job*jp)
+{
+        unsigned int n=0;
+        Job**jpp;
+
+        jp->next=NULL;
+
+        for(jpp=&donelist;*jpp;jpp=&(*jpp)->next)
+                n++;
+
+        *jpp=jp;
+
+        if(n>=JOB_DONE_KEEP)
+        {
+                jp=donelist;
+                donelist=jp->next;
+                free_job(jp);
+        }
+}
+
+/*
+	Report a background command that has finished with stat_loc, and
+	forget it unless it left output to show.
+*/
+
+static void finish_job(Job*jptr,int stat_loc)
+{
+        Job**jpp;
+
+        for(jpp=&joblist;*jpp!=jptr;jpp=&(*jpp)->next)
+                ;
+
+        *jpp=jptr->next;
+        place_release(jptr);
+
+        if(jptr->gate>=0)
+                throttle_release(jptr,0);
+
+        if(jptr->timer>=0)
+        {
+                event_close(jptr->timer);
+                jptr->timer=-1;
+        }
+
+        if(jptr->statfd>=0)
+                close(jptr->statfd);
+
+        if(jptr->iofd>=0)
+                close(jptr->iofd);
+
+        jptr->statfd=jptr->iofd=-1;
+
+        if(WIFEXITED(stat_loc))
+                printf("End\tpid: %d job: %u argv: %s exit: %d\n",
+                        (int)jptr->pid,jptr->id,jptr->cmdbuf,WEXITSTATUS(stat_loc));
+
+        wait_handler(stat_loc);
+        job_drain(jptr);
+
+        if(jptr->ring.len||jptr->fd>=0)
+                keep_done_job(jptr);
+        else
+                free_job(jptr);
+}
+
+/*
+	Report and forget background commands that have finished, keeping
+	their status in reaped for wait.
+*/
+
+static void reap_jobs(void)
+{
+        Job*jptr,*next;
+
+        for(jptr=joblist;jptr;jptr=next)
+        {
+		int stat_loc=0;
+
+                next=jptr->next;
+
+                if(waitpid(jptr->pid,&stat_loc,WNOHANG)==jptr->pid)
+                {
+                        if(nreaped==JOB_REAPED_KEEP)
+                                reaped_drop(0);
+
+                        reaped[nreaped].pid=jptr->pid;
+                        reaped[nreaped].id=jptr->id;
+                        reaped[nreaped++].status=job_status(jptr,stat_loc);
+                        finish_job(jptr,stat_loc);
+                }
+	}
+}
+
+/*
+	Hold off until child pid exits, keeping job output flowing.  The
+	caller still reaps it.
+*/
+
+static int fg_yield(pid_t pid);
+static void fg_unyield(void);
+
+static void event_wait_pid(pid_t pid)
+{
+        int fd;
+
+        if(!nwatched||event_owner!=getpid())
+                return;
+
+        if((fd=syscall(SYS_pidfd_open,pid,0))<0)
+                return;
+
+        event_wait(&fd,1,-1);
+        close(fd);
+}
+
+/*
+	Wait for a foreground child.
+
+	Postcondition: returns its exit status
+*/
+
+static int wait_fg(pid_t pid)
+{
+	int stat_loc=0,yielded=fg_yield(pid);
+
+        event_wait_pid(pid);
+
+        while(waitpid(pid,&stat_loc,0)<0)
+                if(errno!=EINTR)
+                {
+                        shfault("waitpid: %s",strerror(errno));
+
+                        if(yielded)
+                                fg_unyield();
+
+                        return 1;
+                }
+
+        if(yielded)
+                fg_unyield();
+
+        wait_handler(stat_loc);
+
+        return exit_status(stat_loc);
+}
+
+static int run_list(Input*ip);
+static int run_compound(Input*ip);
+static void procsubst_done(size_t mark,int wait);
+
+/*
+	Give the shell (or, in a child, the command about to be run)
+	the variables bound by NAME=value words.  putenv() keeps the
+	expanded string itself, so there is no further copy.
+*/
+
+static void assign(char**assigns)
+{
+        register char**pp;
+
+        for(pp=assigns;pp&&*pp;pp++)
+                if(putenv(expand_string(*pp)))
+                        shfail("putenv");
+}
+
+/*
+	Run a builtin in the shell process itself, redirecting around it.
+*/
+
+static int run_builtin(Input*ip,char**argv)
+{
+        int saved[10],status=1;
+        register int fd;
+
+        for(fd=0;fd<10;fd++)
+                saved[fd]=-2;
+
+        /* Output stays buffered across builtins unless it is about to
+           be sent elsewhere. */
+        if(ip->redirs)
+                fflush(stdout);
+
+        if(!redirect(ip->redirs,saved))
+        {
+                subst_status=0;
+                assign(ip->assigns);
+                status=*argv?ip->internal(argv):subst_status;
+        }
+
+        if(ip->redirs)
+        {
+                fflush(stdout);
+                unredirect(saved);
+        }
+
+        return status;
+}
+
+/*
+	The work of a forked child: exec the program, or run the builtin
+	or compound command.  Never returns.
+*/
+
+static void run_child(Input*ip,char**argv)
+{
+        int status;
+
+        in_child=1;
+
+        /* The shell's own SIGTERM immunity is not for its commands:
+           a time limit relies on SIGTERM reaching them. */
+        signal(SIGTERM,SIG_DFL);
+
+        /* The child leaves with _exit(): exit() would rewind a
+           shared, seekable stdin to what stdio had consumed. */
+        if(ip->kind!=IN_SIMPLE)
+                status=run_compound(ip);
+        else if(redirect(ip->redirs,NULL))
+                status=EXIT_FAILURE;
+        else
+        {
+                close_stray_fds(STDERR_FILENO+1);
+                assign(ip->assigns);
+
+                command_child=1;
+
+                if(!*argv)
+                        status=EXIT_SUCCESS;
+                else if(ip->internal)
+                        status=ip->internal(argv);
+                else
+                {
+                        execvp(argv[0],argv);
+			shfault("%s: %s",argv[0],strerror(errno));
+
+                        status=errno==ENOENT?127:126;
+                }
+        }
+
+        fflush(stdout);
+        _exit(status);
+}
+
+/*
+	Parse timeout [-k grace] duration command...
+
+	Postcondition: returns the command, or NULL after a complaint
+*/
+
+static char**timeout_command(char**argv,double*secs,double*grace)
+{
+        char**pp=argv+1;
+
+        if(*pp&&!strcmp(*pp,"-k"))
+        {
+                if(!pp[1]||parse_duration(pp[1],grace))
+                        goto usage;
+
+                pp+=2;
+        }
+
+        if(!*pp||parse_duration(*pp,secs)||!pp[1])
+                goto usage;
+
+        return pp+1;
+
+usage:
+        shfault("timeout: usage: timeout [-k grace] duration command...");
+
+        return NULL;
+}
+
+/*
+	Run a command in the current process, as a builtin or by exec.
+*/
+
+static int run_argv(char**argv)
+{
+        Builtin internal=lookup_builtin(argv[0]);
+
+        if(internal)
+                return internal(argv);
+
+        fflush(stdout);
+        execvp(argv[0],argv);
+        shfault("%s: %s",argv[0],strerror(errno));
+
+        return errno==ENOENT?127:126;
+}
+
+/*
+	timeout [-k grace] duration command...: run command, sending it
+	SIGTERM once duration has passed and SIGKILL grace seconds after
+	that (5 by default, none if 0).  Durations take an s, m, h or d
+	suffix.  As a job the limit is a timer in the shell's event loop,
+	and job_timed tells the child to just run the command; otherwise
+	the command is forked and waited for here, on its pidfd and a
+	timerfd together.
+
+	Postcondition: returns 124 if the command timed out, 137 if it
+		       had to be killed, or its status
+*/
+
+static int builtin_timeout(char**argv)
+{
+        double secs,grace=TIMEOUT_GRACE;
+        char**cmd=timeout_command(argv,&secs,&grace);
+        int fds[2]={-1,-1},stat_loc=0,signalled=0,yielded=0,i;
+        pid_t pid;
+
+        if(!cmd)
+                return 125;
+
+        if(job_timed)
+        {
+                job_timed=0;
+                return run_argv(cmd);
+        }
+
+        fflush(stdout);
+
+        if((pid=fork())<0)
+        {
+                shfault("%s",strerror(errno));
+                return 125;
+        }
+
+        if(!pid)
+        {
+                in_child=command_child=1;
+                signal(SIGTERM,SIG_DFL);
+                close_stray_fds(STDERR_FILENO+1);
+                i=run_argv(cmd);
+                fflush(stdout);
+                _exit(i);
+        }
+
+        if(secs>0)
+        {
+                fds[0]=syscall(SYS_pidfd_open,pid,0);
+                fds[1]=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+
+                if(fds[0]<0||fds[1]<0||timer_arm(fds[1],secs))
+                        shfault("timeout: %s",strerror(errno));
+                else
+                {
+                        yielded=fg_yield(pid);
+
+                        while((i=event_wait(fds,2,-1))==1)
+                        {
+                                uint64_t ticks;
+
+                                if(read(fds[1],&ticks,sizeof ticks)!=sizeof ticks)
+                                {
+                                        shfault("timeout: %s",strerror(errno));
+                                        break;
+                                }
+
+                                kill(pid,signalled++?SIGKILL:SIGTERM);
+
+                                if(signalled>1||grace<=0||timer_arm(fds[1],grace))
+                                        break;
+                        }
+                }
+
+                for(i=0;i<2;i++)
+                        if(fds[i]>=0)
+                                close(fds[i]);
+        }
+        else
+                yielded=fg_yield(pid);
+
+        while(waitpid(pid,&stat_loc,0)<0)
+                if(errno!=EINTR)
+                {
+                        shfault("waitpid: %s",strerror(errno));
+
+                        if(yielded)
+                                fg_unyield();
+
+                        return 125;
+                }
+
+        if(yielded)
+                fg_unyield();
+
+        if(signalled)
+                return signalled>1?137:124;
+
+        return exit_status(stat_loc);
+}
+
+/*
+	Attributes given to with: CPU affinity, nice value, I/O priority
+	and resource limits, to apply to the process of a command before
+	it execs.
+*/
+
+#define IOPRIO_CLASS_SHIFT 13
+#define SPAWN_LIMITS 8
+
+typedef struct
+{
+        cpu_set_t cpus;
+        int affinity,nice,ioprio;
+        unsigned int renice:1;
+        int nlimits;
+        struct
+        {
+                int resource;
+                rlim_t value;
+        } limits[SPAWN_LIMITS];
+} Spawn_attr;
+
+/*
+	Parse a CPU list such as 0-3,6 into set.
+
+	Postcondition: returns 0, or -1 if p is not a CPU list
+*/
+
+static int parse_cpus(char*p,cpu_set_t*set)
+{
+        CPU_ZERO(set);
+
+        do
+        {
+                char*end;
+                unsigned long low=strtoul(p,&end,10),high=low;
+
+                if(end==p)
+                        return -1;
+
+                if(*end=='-')
+                {
+                        p=end+1;
+                        high=strtoul(p,&end,10);
+
+                        if(end==p||high<low)
+                                return -1;
+                }
+
+                if(high>=CPU_SETSIZE)
+                        return -1;
+
+                for(;low<=high;low++)
+                        CPU_SET(low,set);
+
+                p=end;
+        } while(*p++==',');
+
+        return p[-1]?-1:0;
+}
+
+/*
+	Parse an I/O priority: idle, be[:level], rt[:level] or a best
+	effort level 0-7.
+*/
+
+static int parse_ioprio(char*p,int*ioprio)
+{
+        int class=2,level=4;
+        char*end;
+
+        if(!strcmp(p,"idle"))
+        {
+                *ioprio=3<<IOPRIO_CLASS_SHIFT;
+                return 0;
+        }
+
+        if(!strncmp(p,"be",2)||!strncmp(p,"rt",2))
+        {
+                class=*p=='r'?1:2;
+                p+=2;
+
+                if(!*p)
+                        goto done;
+
+                if(*p++!=':')
+                        return -1;
+        }
+
+        level=strtol(p,&end,10);
+
+        if(end==p||*end||level<0||level>7)
+                return -1;
+
+done:
+        *ioprio=class<<IOPRIO_CLASS_SHIFT|level;
+
+        return 0;
+}
+
+/*
+	Yielding to the foreground.  With JOB_YIELD set to a nice value, a
+	foreground command still running after YIELD_DELAY milliseconds
+	has the running jobs niced to it and put in the idle I/O class
+	until it ends, when each gets back its own priorities, kept in
+	its Job.  Quicker commands cost nothing per job, and the jobs are
+	changed in one pass either way.  The nice value of a job is left
+	alone if it could not be lowered again for want of privilege.
+*/
+
+#define YIELD_DELAY 50
+
+static int yielding;
+
+/*
+	Set a nice value or I/O priority on one task of a job, for
+	job_tasks(): every thread and process of a job yields, not only
+	the one the shell started.
+*/
+
+static int task_nice(pid_t tid,void*nice)
+{
+        return setpriority(PRIO_PROCESS,tid,(int)*(long*)nice);
+}
+
+static int task_ioprio(pid_t tid,void*ioprio)
+{
+        return syscall(SYS_ioprio_set,1,tid,*(int*)ioprio);
+}
+
+static int fg_yield(pid_t pid)
+{
+        char*p=getenv("JOB_YIELD"),*end;
+        long nice;
+        int fd,floor=-20,idle;
+        struct rlimit rl;
+        Job*jp;
+
+        if(!p||!*p||!joblist||yielding||in_child)
+                return 0;
+
+        nice=strtol(p,&end,10);
+
+        if(*end||nice<-20||nice>19)
+        {
+                shfault("JOB_YIELD: %s: invalid nice value",p);
+                return 0;
+        }
+
+        if((fd=syscall(SYS_pidfd_open,pid,0))>=0)
+        {
+                int ready=event_wait(&fd,1,YIELD_DELAY);
+
+                close(fd);
+
+                if(!ready)
+                        return 0;
+        }
+
+        if(geteuid()&&!getrlimit(RLIMIT_NICE,&rl))
+                floor=rl.rlim_cur==RLIM_INFINITY||rl.rlim_cur>40?-20:20-(int)rl.rlim_cur;
+
+        for(jp=joblist;jp;jp=jp->next)
+        {
+                int old;
+
+                if(jp->gate>=0)
+                        continue;
+
+                errno=0;
+                old=getpriority(PRIO_PROCESS,jp->pid);
+
+                if(!errno&&old<nice&&old>=floor&&!job_tasks(jp->pid,task_nice,&nice))
+                {
+                        jp->nice=old;
+                        jp->yielded|=1;
+                }
+
+                idle=3<<IOPRIO_CLASS_SHIFT;
+
+                if((old=syscall(SYS_ioprio_get,1,jp->pid))>=0
+                   &&!job_tasks(jp->pid,task_ioprio,&idle))
+                {
+                        jp->ioprio=old;
+                        jp->yielded|=2;
+                }
+        }
+
+        return yielding=1;
+}
+
+static void fg_unyield(void)
+{
+        Job*jp;
+
+        for(jp=joblist;jp;jp=jp->next)
+        {
+                long nice=jp->nice;
+                int ioprio=jp->ioprio;
+
+                if(jp->yielded&1)
+                        job_tasks(jp->pid,task_nice,&nice);
+
+                if(jp->yielded&2)
+                        job_tasks(jp->pid,task_ioprio,&ioprio);
+
+                jp->yielded=0;
+        }
+
+        yielding=0;
+}
+
+/*
+	Parse with's name=value attributes, up to -- or the first word
+	that is not one: cpus=LIST, nice=N, io=PRIO, and the limits
+	mem=SIZE (address space), files=N and procs=N.
+
+	Postcondition: returns the command, or NULL after a complaint
+*/
+
+static char**spawn_attr_parse(char**argv,Spawn_attr*ap)
+{
+        char**pp;
+
+        memset(ap,0,sizeof *ap);
+        ap->ioprio=-1;
+
+        for(pp=argv+1;*pp&&strchr(*pp,'=');pp++)
+        {
+                char*value=strchr(*pp,'=')+1;
+                unsigned long long n;
+                int resource=-1,bad=0;
+
+                if(!strncmp(*pp,"cpus=",5))
+                {
+                        bad=parse_cpus(value,&ap->cpus);
+                        ap->affinity=1;
+                }
+                else if(!strncmp(*pp,"nice=",5))
+                {
+                        char*end;
+
+                        ap->nice=strtol(value,&end,10);
+                        ap->renice=1;
+                        bad=end==value||*end;
+                }
+                else if(!strncmp(*pp,"io=",3))
+                        bad=parse_ioprio(value,&ap->ioprio);
+                else if(!strncmp(*pp,"mem=",4))
+                        resource=RLIMIT_AS;
+                else if(!strncmp(*pp,"files=",6))
+                        resource=RLIMIT_NOFILE;
+                else if(!strncmp(*pp,"procs=",6))
+                        resource=RLIMIT_NPROC;
+                else
+                        bad=1;
+
+                if(resource>=0)
+                {
+                        if(ap->nlimits==SPAWN_LIMITS||parse_size(value,&n))
+                                bad=1;
+                        else
+                        {
+                                ap->limits[ap->nlimits].resource=resource;
+                                ap->limits[ap->nlimits++].value=n;
+                        }
+                }
+
+                if(bad)
+                {
+                        shfault("with: %s: invalid attribute",*pp);
+                        return NULL;
+                }
+        }
+
+        if(*pp&&!strcmp(*pp,"--"))
+                pp++;
+
+        if(!*pp)
+        {
+                shfault("with: usage: with name=value... [--] command...");
+                return NULL;
+        }
+
+        return pp;
+}
+
+/*
+	Apply attributes to the calling process.
+
+	Postcondition: returns 0, or -1 after a complaint
+*/
+
+static int spawn_attr_apply(Spawn_attr*ap)
+{
+        int i;
+
+        for(i=0;i<ap->nlimits;i++)
+        {
+                struct rlimit rl;
+
+                getrlimit(ap->limits[i].resource,&rl);
+                rl.rlim_cur=ap->limits[i].value;
+
+                if(rl.rlim_max!=RLIM_INFINITY&&rl.rlim_cur>rl.rlim_max)
+                        rl.rlim_cur=rl.rlim_max;
+
+                if(setrlimit(ap->limits[i].resource,&rl))
+                {
+                        shfault("with: setrlimit: %s",strerror(errno));
+                        return -1;
+                }
+        }
+
+        if(ap->affinity&&sched_setaffinity(0,sizeof ap->cpus,&ap->cpus))
+        {
+                shfault("with: cpus: %s",strerror(errno));
+                return -1;
+        }
+
+        if(ap->renice&&setpriority(PRIO_PROCESS,0,ap->nice))
+        {
+                shfault("with: nice: %s",strerror(errno));
+                return -1;
+        }
+
+        if(ap->ioprio>=0&&syscall(SYS_ioprio_set,1,0,ap->ioprio))
+        {
+                shfault("with: io: %s",strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+	with name=value... [--] command...: run command with the CPU
+	affinity, nice value, I/O priority and limits given, set on its
+	own process between fork and exec, without wrapper programs.  A
+	job or pipeline stage already has that process; in the shell, one
+	is forked.
+
+	Postcondition: returns 125 if the attributes were bad or could not
+		       be applied, or the command's status
+*/
+
+static int builtin_with(char**argv)
+{
+        Spawn_attr attr;
+        char**cmd=spawn_attr_parse(argv,&attr);
+        pid_t pid;
+
+        if(!cmd)
+                return 125;
+
+        if(command_child)
+                return spawn_attr_apply(&attr)?125:run_argv(cmd);
+
+        fflush(stdout);
+
+        if((pid=fork())<0)
+        {
+                shfault("%s",strerror(errno));
+                return 125;
+        }
+
+        if(!pid)
+        {
+                int status=125;
+
+                in_child=command_child=1;
+                signal(SIGTERM,SIG_DFL);
+                close_stray_fds(STDERR_FILENO+1);
+
+                if(!spawn_attr_apply(&attr))
+                        status=run_argv(cmd);
+
+                fflush(stdout);
+                _exit(status);
+        }
+
+        return wait_fg(pid);
+}
+
+/*
+	The spawn pool.  With JOB_SPAWNERS set to a number of threads, a
+	background job that is a plain program, with no redirections,
+	assignments or anything else to do in a child of the shell, is
+	launched by one of that many threads with posix_spawn() rather
+	than by forking the shell, so that launches overlap each other
+	and the shell reading on.  The shell adds a Spawn_req at the tail
+	of spawn_queue and posts spawn_sem; a thread takes it from the
+	head with a compare-and-swap, spawns, and pushes it onto
+	spawn_done, writing to the eventfd spawn_event, by which the
+	event loop makes a job of it.  spawn_pending counts those not yet
+	back, and is kept to the size of the queue, so that the shell
+	never adds to a slot still to be taken.  A job thus appears once
+	its process has started, in the order the launches finished.  The
+	CPU and NUMA node of a job are picked as for a forked one, and
+	given to the spawning thread for the new process to inherit.  A
+	program that could not be started still makes a job, one that
+	reports why and exits 127 or 126 as a forked child would.
+*/
+
+#define SPAWN_QUEUE 256
+#define SPAWN_THREADS 64
+#define SPAWN_STACK 65536
+
+typedef struct Spawn_req_def
+{
+        char**argv,**envp;
+        char*cmdbuf;
+        int out,fd,cpu,node,lines,error;
+        Ring ring;
+        double secs,grace;
+        pid_t pid;
+        struct Spawn_req_def*next;
+} Spawn_req;
+
+static Spawn_req*spawn_queue[SPAWN_QUEUE];
+static unsigned long spawn_head,spawn_tail;
+static Spawn_req*spawn_done;
+static sem_t spawn_sem;
+static sigset_t spawn_mask;
+static int spawn_event=-1,spawn_threads;
+static pid_t spawn_owner;
+static unsigned int spawn_pending;
+
+/*
+	Search the request's own PATH, as execvp() would, since the
+	shell's environment may change under a spawning thread.
+*/
+
+static int spawn_path(Spawn_req*rp,posix_spawn_file_actions_t*actions,posix_spawnattr_t*attr)
+{
+        char path[PATH_MAX],*dirs="/bin:/usr/bin",**pp;
+        int error=ENOENT;
+
+        for(pp=rp->envp;*pp;pp++)
+                if(!strncmp(*pp,"PATH=",5))
+                        dirs=*pp+5;
+
+        for(;;)
+        {
+                size_t n=strcspn(dirs,":");
+
+                if(snprintf(path,sizeof path,"%.*s%s%s",(int)n,n?dirs:".","/",rp->argv[0])<(int)sizeof path)
+                {
+                        if(!access(path,X_OK))
+                                return posix_spawn(&rp->pid,path,actions,attr,rp->argv,rp->envp);
+
+                        if(errno==EACCES)
+                                error=EACCES;
+                }
+
+                if(!dirs[n])
+                        return error;
+
+                dirs+=n+1;
+        }
+}
+
+static void spawn_run(Spawn_req*rp)
+{
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        cpu_set_t cpus;
+        sigset_t dfl;
+        int placed=(rp->node>=0||rp->cpu>=0)&&!sched_getaffinity(0,sizeof cpus,&cpus);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+
+        if(rp->out>=0)
+        {
+                posix_spawn_file_actions_adddup2(&actions,rp->out,STDOUT_FILENO);
+                posix_spawn_file_actions_adddup2(&actions,rp->out,STDERR_FILENO);
+        }
+
+        posix_spawn_file_actions_addclosefrom_np(&actions,STDERR_FILENO+1);
+
+        /* As in run_child(), and with the shell's own signal mask. */
+        sigemptyset(&dfl);
+        sigaddset(&dfl,SIGTERM);
+        posix_spawnattr_setsigdefault(&attr,&dfl);
+        posix_spawnattr_setsigmask(&attr,&spawn_mask);
+        posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+
+        /* Affinity and memory policy are the thread's own, and are
+           inherited by what it spawns. */
+        if(placed&&rp->node>=0)
+                node_bind(rp->node);
+
+        if(placed&&rp->cpu>=0)
+                pin_cpu(0,rp->cpu);
+
+        if(strchr(rp->argv[0],'/'))
+                rp->error=posix_spawn(&rp->pid,rp->argv[0],&actions,&attr,rp->argv,rp->envp);
+        else
+                rp->error=spawn_path(rp,&actions,&attr);
+
+        if(placed)
+        {
+                sched_setaffinity(0,sizeof cpus,&cpus);
+
+                if(rp->node>=0)
+                        syscall(SYS_set_mempolicy,MPOL_DEFAULT,NULL,0UL);
+        }
+
+        /* A failed launch keeps it for spawn_failed(). */
+        if(rp->out>=0&&!rp->error)
+                close(rp->out);
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+}
+
+static void*spawn_thread(void*unused)
+{
+        Spawn_req*rp;
+        unsigned long head;
+        uint64_t one=1;
+
+        (void)unused;
+
+        for(;;)
+        {
+                while(sem_wait(&spawn_sem))
+                        ;
+
+                /* The post promised a request; take the one at head. */
+                head=__atomic_load_n(&spawn_head,__ATOMIC_ACQUIRE);
+
+                do
+                        rp=spawn_queue[head%SPAWN_QUEUE];
+                while(!__atomic_compare_exchange_n(&spawn_head,&head,head+1,1,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+
+                spawn_run(rp);
+
+                rp->next=__atomic_load_n(&spawn_done,__ATOMIC_RELAXED);
+
+                while(!__atomic_compare_exchange_n(&spawn_done,&rp->next,rp,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+                        ;
+
+                while(write(spawn_event,&one,sizeof one)<0&&errno==EINTR)
+                        ;
+        }
+
+        return NULL;
+}
+
+/*
+	The number of spawning threads asked for by JOB_SPAWNERS, starting
+	any not yet running.
+
+	Postcondition: returns 0 if there are none to use
+*/
+
+static int spawn_pool(void)
+{
+        char*p=getenv("JOB_SPAWNERS"),*end;
+        long n;
+        pthread_attr_t attr;
+        sigset_t all;
+
+        if(!p||!*p||in_child)
+                return 0;
+
+        n=strtol(p,&end,10);
+
+        if(*end||n<0||n>SPAWN_THREADS)
+        {
+                shfault("JOB_SPAWNERS: %s: invalid thread count",p);
+                return 0;
+        }
+
+        if(n<=spawn_threads)
+                return n;
+
+        if(spawn_event<0)
+        {
+                if(sem_init(&spawn_sem,0,0)
+                   ||(spawn_event=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC))<0)
+                {
+                        shfault("spawn: %s",strerror(errno));
+                        return 0;
+                }
+
+                if(event_watch(spawn_event,NULL,EVENT_SPAWN))
+                {
+                        close(spawn_event);
+                        spawn_event=-1;
+                        return 0;
+                }
+
+                spawn_owner=getpid();
+        }
+
+        /* Signals are for the shell's own thread. */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK,&all,&spawn_mask);
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr,SPAWN_STACK<PTHREAD_STACK_MIN?PTHREAD_STACK_MIN:SPAWN_STACK);
+        pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+
+        while(spawn_threads<n)
+        {
+                pthread_t thread;
+
+                if((errno=pthread_create(&thread,&attr,spawn_thread,NULL)))
+                {
+                        shfault("spawn: %s",strerror(errno));
+                        break;
+                }
+
+                spawn_threads++;
+        }
+
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK,&spawn_mask,NULL);
+
+        return spawn_threads;
+}
+
+/*
+	Stand in for a program the pool could not start: fork a child that
+	reports it and exits as run_argv() would have.
+
+	Postcondition: returns the child, or -1
+*/
+
+static pid_t spawn_failed(Spawn_req*rp)
+{
+        pid_t pid;
+
+        fflush(stdout);
+
+        if(!(pid=fork()))
+        {
+                in_child=command_child=1;
+
+                if(rp->out>=0)
+                {
+                        dup2(rp->out,STDOUT_FILENO);
+                        dup2(rp->out,STDERR_FILENO);
+                }
+
+                shfault("%s: %s",rp->argv[0],strerror(rp->error));
+                _exit(rp->error==ENOENT?127:126);
+        }
+
+        if(pid<0)
+                shfault("%s",strerror(errno));
+
+        if(rp->out>=0)
+                close(rp->out);
+
+        return pid;
+}
+
+/*
+	Make jobs of the launches that have come back.
+*/
+
+static void spawn_collect(void)
+{
+        Spawn_req*rp,*next,*list=NULL;
+        uint64_t count;
+
+        while(read(spawn_event,&count,sizeof count)<0&&errno==EINTR)
+                ;
+
+        /* Pushed last first: turn it round. */
+        for(rp=__atomic_exchange_n(&spawn_done,NULL,__ATOMIC_ACQUIRE);rp;rp=next)
+        {
+                next=rp->next;
+                rp->next=list;
+                list=rp;
+        }
+
+        for(rp=list;rp;rp=next)
+        {
+                next=rp->next;
+                spawn_pending--;
+
+                if(rp->error)
+                        rp->pid=spawn_failed(rp);
+
+                if(rp->pid>0)
+                {
+                        Job*jp=add_job(rp->pid,rp->cmdbuf,rp->fd,&rp->ring,rp->lines,rp->secs,rp->grace,-1);
+
+                        jp->cpu=rp->cpu;
+                        jp->node=rp->node;
+                }
+                else
+                {
+                        if(rp->fd>=0)
+                                close(rp->fd);
+
+                        if(rp->cpu>=0)
+                                place_load[rp->cpu]--;
+
+                        if(rp->node>=0)
+                                node_load[rp->node]--;
+
+                        ring_free(&rp->ring);
+                }
+
+                free(rp);
+        }
+}
+
+/*
+	Wait until at most most launches are still out: none, for those
+	who look at all jobs.  Only the shell that made the pool has any.
+*/
+
+static void spawn_settle(unsigned int most)
+{
+        struct pollfd pfd;
+
+        if(spawn_event<0||spawn_owner!=getpid())
+                return;
+
+        pfd.fd=spawn_event;
+        pfd.events=POLLIN;
+
+        while(spawn_pending>most)
+        {
+                if(poll(&pfd,1,-1)<0&&errno!=EINTR)
+                        break;
+
+                spawn_collect();
+        }
+}
+
+/*
+	Hand a background job to the spawn pool.  argv is copied, and the
+	environment taken as it is now.
+*/
+
+static void spawn_queue_add(Input*ip,char**argv,int pfd[2],Ring*rp,int lines,double secs,double grace,int cpu,int node)
+{
+        size_t argc,envc,size=0,i;
+        Spawn_req*sp;
+        char*p;
+
+        for(argc=0;argv[argc];argc++)
+                size+=strlen(argv[argc])+1;
+
+        for(envc=0;environ[envc];envc++)
+                ;
+
+        spawn_settle(SPAWN_QUEUE-1);
+
+        sp=malloc(sizeof *sp+(argc+envc+2)*sizeof(char*)+size);
+        if(!sp)
+                shfail("malloc");
+
+        sp->argv=(char**)(sp+1);
+        sp->envp=sp->argv+argc+1;
+        p=(char*)(sp->envp+envc+1);
+
+        for(i=0;i<argc;i++)
+        {
+                sp->argv[i]=p;
+                p=stpcpy(p,argv[i])+1;
+        }
+
+        sp->argv[argc]=NULL;
+        memcpy(sp->envp,environ,(envc+1)*sizeof(char*));
+        sp->cmdbuf=ip->cmdbuf;
+        sp->out=pfd[1];
+        sp->fd=pfd[0];
+        sp->ring=*rp;
+        sp->lines=lines;
+        sp->secs=secs;
+        sp->grace=grace;
+        sp->cpu=cpu;
+        sp->node=node;
+        sp->error=0;
+        sp->pid=0;
+
+        if(cpu>=0)
+                place_load[cpu]++;
+
+        spawn_queue[spawn_tail%SPAWN_QUEUE]=sp;
+        __atomic_store_n(&spawn_tail,spawn_tail+1,__ATOMIC_RELEASE);
+        spawn_pending++;
+        sem_post(&spawn_sem);
+}
+
+/*
+	Fork a child for a command: exec the program, run a builtin in the
+	background, or run a compound command in the background.
+	Foreground children are waited for; background ones become jobs.
+
+	Postcondition: returns the exit status for $?
+*/
+
+static int spawn(Input*ip,char**argv)
+{
+        pid_t pid;
+        Ring ring={0};
+        int pfd[2]={-1,-1},gate[2]={-1,-1},lines=0,timed=0,cpu=-1,domain=-1,node=-1;
+        double secs=0,grace=TIMEOUT_GRACE;
+
+        /* The time limit of a job is kept by the shell itself. */
+        if(ip->background)
+        {
+                char*p=getenv("JOB_TIMEOUT");
+
+                if(ip->kind==IN_SIMPLE&&ip->internal==builtin_timeout)
+                {
+                        if(!timeout_command(argv,&secs,&grace))
+                                return 125;
+
+                        timed=1;
+                }
+                else if(p&&*p&&parse_duration(p,&secs))
+                        shfault("JOB_TIMEOUT: %s: invalid duration",p);
+        }
+
+        if(ip->background&&job_capture(&ring,pfd,&lines))
+                pfd[0]=pfd[1]=-1;
+
+        /* Under pressure, or behind jobs held for it, a job waits. */
+        if(ip->background&&(throttled||pressure_high(1))&&pipe2(gate,O_CLOEXEC))
+        {
+                shfault("gate: %s",strerror(errno));
+                gate[0]=gate[1]=-1;
+        }
+
+        /* with sets its own CPUs, if any.  Others are bound to a node,
+           and a pipeline's stages are placed in a cache domain of
+           their own. */
+        if(ip->background&&!(ip->kind==IN_SIMPLE&&ip->internal==builtin_with))
+        {
+                if((node=node_pick())>=0)
+                        node_load[node]++;
+
+                if(ip->kind==IN_PIPE&&(domain=place_domain_pick(node))>=0)
+                        place_domain_load[domain]++;
+                else
+                        cpu=place_pick(node);
+        }
+
+        /* A plain program needs nothing of the shell in its child. */
+        if(ip->background&&ip->kind==IN_SIMPLE&&*argv&&!lookup_builtin(*argv)&&!ip->redirs
+           &&!(ip->assigns&&*ip->assigns)&&!nprocsubst&&gate[0]<0&&spawn_pool())
+        {
+                spawn_queue_add(ip,argv,pfd,&ring,lines,secs,grace,cpu,node);
+                return 0;
+        }
+
+        fflush(stdout);
+
+        pid=fork();
+        if(!pid) /* child */
+        {
+                if(pfd[1]>=0)
+                {
+                        dup2(pfd[1],STDOUT_FILENO);
+                        dup2(pfd[1],STDERR_FILENO);
+                }
+
+                if(node>=0)
+                        node_bind(node);
+
+                if(cpu>=0)
+                        pin_cpu(0,cpu);
+
+                pipe_domain=domain;
+                job_timed=timed;
+
+                if(gate[0]>=0)
+                {
+                        ssize_t n;
+                        char c;
+
+                        close(gate[1]);
+                        signal(SIGTERM,SIG_DFL);
+
+                        while((n=read(gate[0],&c,1))<0&&errno==EINTR)
+                                ;
+
+                        /* End of file means the shell has gone without
+                           letting the job run. */
+                        if(n!=1)
+                                _exit(EXIT_FAILURE);
+
+                        close(gate[0]);
+                }
+
+                run_child(ip,argv);
+        }
+
+        /* parent */
+        if(pfd[1]>=0)
+                close(pfd[1]);
+
+        if(gate[0]>=0)
+                close(gate[0]);
+
+        if(pid<0)
+        {
+		shfault("%s",strerror(errno));
+
+                if(pfd[0]>=0)
+                        close(pfd[0]);
+
+                if(domain>=0)
+                        place_domain_load[domain]--;
+
+                if(node>=0)
+                        node_load[node]--;
+
+                if(gate[1]>=0)
+                        close(gate[1]);
+
+                ring_free(&ring);
+
+                return 1;
+        }
+
+        if(ip->background)
+        {
+                Job*jp=add_job(pid,ip->cmdbuf,pfd[0],&ring,lines,secs,grace,gate[1]);
+
+                if(cpu>=0)
+                {
+                        jp->cpu=cpu;
+                        place_load[cpu]++;
+                }
+
+                jp->domain=domain;
+                jp->node=node;
+
+                return 0;
+        }
+
+        return wait_fg(pid);
+}
+
+/*
+	Expand and run a simple command.
+*/
+
+static int run_simple(Input*ip)
+{
+        Vec args={0};
+        Strbuf sb={0};
+        register char**pp;
+        size_t mark=nprocsubst;
+        int status;
+
+        expand_error=0;
+
+        for(pp=ip->cmdvec;*pp;pp++)
+                expand(*pp,&sb,&args);
+
+        free(sb.s);
+
+        if(expand_error)
+        {
+                vec_free(&args);
+                procsubst_done(mark,1);
+                return 1;
+        }
+
+        if(!args.v)
+                vec_push(&args,NULL);
+
+        if((ip->internal||!*args.v)&&!ip->background)
+                status=run_builtin(ip,args.v);
+        else
+                status=spawn(ip,args.v);
+
+        vec_free(&args);
+        procsubst_done(mark,!ip->background);
+
+        return status;
+}
+
+/*
+	A pipeline stage run on a helper thread of the shell: a builtin
+	that moves data between two descriptors it is given.
+*/
+
+typedef int(*Fd_builtin)(int,int,char**);
+
+typedef struct Fd_stage_def
+{
+        pthread_t thread;
+        Fd_builtin run;
+        int in,out,status;
+        Vec args;
+        struct Fd_stage_def*next;
+} Fd_stage;
+
+static Fd_builtin fd_builtin(Input*sp)
+{
+        if(sp->kind!=IN_SIMPLE||sp->redirs||sp->assigns)
+                return NULL;
+
+        if(sp->internal==builtin_tee)
+                return tee_fds;
+
+        if(sp->internal==builtin_meter)
+                return meter_fds;
+
+        return NULL;
+}
+
+static void*fd_stage(void*arg)
+{
+        Fd_stage*ts=arg;
+
+        ts->status=ts->run(ts->in,ts->out,ts->args.v);
+
+        if(ts->in!=STDIN_FILENO)
+                close(ts->in);
+
+        if(ts->out!=STDOUT_FILENO)
+                close(ts->out);
+
+        return NULL;
+}
+
+/*
+	Tell where the stages of a pipeline went, for JOB_PLACE=report.
+*/
+
+static void place_report(Input*ip,int domain)
+{
+        char cpus[256];
+        Input*sp;
+        int i;
+
+        format_domain(cpus,sizeof cpus,domain);
+        fprintf(stderr,"place: pipeline in L%d cache domain %s\n",place_level[domain],cpus);
+
+        for(i=0,sp=ip->body;sp;sp=sp->link,i++)
+                if(fd_builtin(sp))
+                        fprintf(stderr,"place:   stage %d %s: shell thread\n",i+1,sp->cmdvec[0]);
+                else
+                        fprintf(stderr,"place:   stage %d %s: cpu %d\n",i+1,
+                                sp->kind==IN_SIMPLE&&*sp->cmdvec?*sp->cmdvec:"(...)",place_stage_cpu(domain,i));
+}
+
+/*
+	Run the stages of a pipeline at once, each in a child with its
+	stdin and stdout on the pipes between them, except that a plain
+	tee or meter works on the pipe ends from a thread of the shell
+	itself.  Under the cache policy the children are pinned to CPUs
+	sharing a last-level cache, one domain per pipeline.
+
+	Postcondition: returns the status of the last stage
+*/
+
+static int run_pipeline(Input*ip)
+{
+        Input*sp;
+        Fd_stage*stages=NULL,*ts,*final=NULL;
+        pid_t*pids;
+        int in=STDIN_FILENO,pfd[2],status=0,n=0,i;
+        int domain=pipe_domain,placed=0,yielded;
+
+        pipe_domain=-1;
+
+        for(sp=ip->body;sp;sp=sp->link)
+                n++;
+
+        if(domain<0&&n>1&&(domain=place_domain_pick(-1))>=0)
+        {
+                place_domain_load[domain]++;
+                placed=1;
+        }
+
+        pids=calloc(n,sizeof *pids);
+        if(!pids)
+                shfail("calloc");
+
+        fflush(stdout);
+
+        for(i=0,sp=ip->body;sp;sp=sp->link,i++)
+        {
+                int out=STDOUT_FILENO;
+
+                if(sp->link)
+                {
+                        if(pipe2(pfd,O_CLOEXEC)<0)
+                        {
+                                shfault("pipe: %s",strerror(errno));
+                                break;
+                        }
+
+                        out=pfd[1];
+                }
+
+                if(fd_builtin(sp))
+                {
+                        Strbuf sb={0};
+                        register char**pp;
+
+                        ts=calloc(1,sizeof *ts);
+                        if(!ts)
+                                shfail("calloc");
+
+                        expand_error=0;
+
+                        for(pp=sp->cmdvec;*pp;pp++)
+                                expand(*pp,&sb,&ts->args);
+
+                        free(sb.s);
+
+                        ts->run=fd_builtin(sp);
+                        ts->in=in;
+                        ts->out=out;
+                        ts->next=stages;
+                        stages=ts;
+
+                        if(!sp->link)
+                                final=ts;
+
+                        if(!expand_error&&!(errno=pthread_create(&ts->thread,NULL,fd_stage,ts)))
+                        {
+                                in=sp->link?pfd[0]:STDIN_FILENO;
+                                continue;
+                        }
+
+                        if(!expand_error)
+                                shfault("%s: %s",sp->cmdvec[0],strerror(errno));
+
+                        /* The pipes are closed below, as for a child. */
+                        ts->status=1;
+                        ts->thread=pthread_self();
+                }
+                else if(!(pids[i]=fork())) /* child */
+                {
+                        if(domain>=0)
+                                pin_cpu(0,place_stage_cpu(domain,i));
+
+                        if(in!=STDIN_FILENO)
+                                dup2(in,STDIN_FILENO);
+
+                        if(out!=STDOUT_FILENO)
+                                dup2(out,STDOUT_FILENO);
+
+                        if(sp->kind==IN_SIMPLE)
+                        {
+                                Vec args={0};
+                                Strbuf sb={0};
+                                register char**pp;
+
+                                expand_error=0;
+
+                                for(pp=sp->cmdvec;*pp;pp++)
+                                        expand(*pp,&sb,&args);
+
+                                if(!args.v)
+                                        vec_push(&args,NULL);
+
+                                if(expand_error)
+                                        _exit(EXIT_FAILURE);
+
+                                run_child(sp,args.v);
+                        }
+
+                        close_stray_fds(STDERR_FILENO+1);
+                        run_child(sp,NULL);
+                }
+                else if(pids[i]<0)
+                        shfault("%s",strerror(errno));
+
+                if(in!=STDIN_FILENO)
+                        close(in);
+
+                if(out!=STDOUT_FILENO)
+                        close(out);
+
+                in=sp->link?pfd[0]:STDIN_FILENO;
+        }
+
+        if(in!=STDIN_FILENO)
+                close(in);
+
+        if(domain>=0&&place_policy("report"))
+                place_report(ip,domain);
+
+        /* Jobs yield to the whole pipeline, not its last stage alone. */
+        for(i=n-1;i>=0&&pids[i]<=0;i--)
+                ;
+
+        yielded=i>=0&&fg_yield(pids[i]);
+
+        for(i=0;i<n;i++)
+        {
+                if(pids[i]<=0)
+                        continue;
+
+                if(i==n-1)
+                        status=wait_fg(pids[i]);
+                else
+                {
+                        event_wait_pid(pids[i]);
+
+                        while(waitpid(pids[i],NULL,0)<0&&errno==EINTR)
+                                ;
+                }
+        }
+
+        for(ts=stages;ts;ts=stages)
+        {
+                if(!pthread_equal(ts->thread,pthread_self()))
+                        pthread_join(ts->thread,NULL);
+
+                if(ts==final)
+                        status=ts->status;
+
+                stages=ts->next;
+                vec_free(&ts->args);
+                free(ts);
+        }
+
+        if(yielded)
+                fg_unyield();
+
+        free(pids);
+
+        if(placed)
+                place_domain_load[domain]--;
+
+        return status;
+}
+
+/*
+	Run a loop body once and settle any break or continue it left
+	pending.
+
+	Postcondition: returns nonzero if the loop is to be left
+*/
+
+static int run_loop_body(Input*body)
+{
+        run_list(body);
+
+        if(loop_break)
+        {
+                loop_break--;
+                return 1;
+        }
+
+        if(loop_continue)
+                return --loop_continue!=0;
+
+        return 0;
+}
+
+/*
+	Run the first arm of a case with a pattern matching the subject.
+	All the patterns are matched in a single pass, however many arms
+	there are.
+*/
+
+static int run_case(Input*ip)
+{
+        Glob*g=ip->matcher;
+        Input*arm;
+        char*subject;
+        int which;
+
+        expand_error=0;
+        subject=expand_string(ip->name);
+
+        if(!g)
+        {
+                Strbuf key={0};
+                register char**pp;
+
+                for(arm=ip->body;arm;arm=arm->link)
+                        for(pp=arm->cmdvec;*pp;pp++)
+                        {
+                                char*pattern=expand_operand(*pp,1);
+
+                                sb_putn(&key,pattern,strlen(pattern)+1);
+                                free(pattern);
+                        }
+
+                if(ip->dynamic)
+                        g=glob_compile(key.s,key.len,0);
+                else
+                        g=ip->matcher=glob_build(key.s,key.len,0);
+
+                free(key.s);
+        }
+
+        which=glob_which(g,subject,strlen(subject));
+        free(subject);
+
+        if(expand_error)
+                return 1;
+
+        for(arm=ip->body;arm&&which>=0;arm=arm->link)
+        {
+                register char**pp;
+
+                for(pp=arm->cmdvec;*pp&&which;pp++)
+                        which--;
+
+                if(*pp)
+                        return arm->body?run_list(arm->body):0;
+        }
+
+        return 0;
+}
+
+/*
+	Run an if, while, for or background list in the shell process,
+	with the redirections given after it in effect throughout.
+*/
+
+static int run_compound(Input*ip)
+{
+        int saved[10],status=0,redirected=ip->redirs!=NULL;
+        size_t mark=nprocsubst;
+        register int fd;
+
+        for(fd=0;fd<10;fd++)
+                saved[fd]=-2;
+
+        if(redirected)
+        {
+                fflush(stdout);
+
+                if(redirect(ip->redirs,saved))
+                {
+                        unredirect(saved);
+                        return 1;
+                }
+        }
+
+        switch(ip->kind)
+        {
+                case IN_LIST:
+                        status=run_list(ip->body);
+                        break;
+                case IN_IF:
+                        for(;ip;ip=ip->elsepart)
+                        {
+                                if(ip->kind!=IN_IF||!run_list(ip->cond))
                                 {
-                                        Input*histp=histlist->next;
+                                        status=run_list(ip->body);
+                                        break;
+                                }
+                        }
+
+                        break;
+                case IN_WHILE:
+                        loop_depth++;
+
+                        while(!loop_break&&(!run_list(ip->cond))!=ip->until)
+                        {
+                                int leave=run_loop_body(ip->body);
+
+                                status=last_status;
+
+                                if(leave)
+                                        break;
+                        }
+
+                        loop_depth--;
+                        break;
+                case IN_FOR:
+                {
+                        Vec words={0};
+                        Strbuf sb={0};
+                        register char**pp;
+
+                        expand_error=0;
+
+                        for(pp=ip->cmdvec;*pp;pp++)
+                                expand(*pp,&sb,&words);
+
+                        free(sb.s);
+
+                        if(expand_error)
+                        {
+                                vec_free(&words);
+                                status=1;
+                                break;
+                        }
+
+                        loop_depth++;
+
+                        for(pp=words.v;pp&&*pp;pp++)
+                        {
+                                setvar(ip->name,*pp);
+
+                                if(run_loop_body(ip->body))
+                                        break;
+                        }
+
+                        status=words.n?last_status:0;
+                        loop_depth--;
+                        vec_free(&words);
+                        break;
+                }
+                case IN_CASE:
+                        status=run_case(ip);
+                        break;
+                case IN_PIPE:
+                        status=run_pipeline(ip);
+                        break;
+        }
+
+        if(redirected)
+        {
+                fflush(stdout);
+                unredirect(saved);
+        }
+
+        procsubst_done(mark,1);
+
+        return status;
+}
+
+/*
+	Run one command of a chain.
+*/
+
+static int run_command(Input*ip)
+{
+        if(ip->kind==IN_SIMPLE)
+                return run_simple(ip);
+
+        if(ip->background)
+                return spawn(ip,NULL);
+
+        return run_compound(ip);
+}
+
+/*
+	Run a chain of commands, skipping those whose && or || condition
+	fails on the status left by the command before.  $? is updated as
+	each command finishes.  A pending break or continue cuts the
+	chain short.
+*/
+
+static int run_list(Input*ip)
+{
+        for(;ip&&!loop_break&&!loop_continue;ip=ip->link)
+        {
+                if(ip->op==OP_AND&&last_status)
+                        continue;
 
-                                        free(histlist);
-                                        histlist=histp;
-                                }
+                if(ip->op==OP_OR&&!last_status)
+                        continue;
 
-                                hptr->next=calloc(1,sizeof *(hptr->next));
-                                hptr=hptr->next;
-                        }
-                        else
-                        {
-                                histlist=calloc(1,sizeof *histlist);
-                                hptr=histlist;
-                        }
+                last_status=run_command(ip);
+        }
 
-                        if(!hptr)
-                                shfail("calloc");
+        return last_status;
+}
+
+/*
+	Parsed command substitutions, by text.  The text is the source as
+	written, so it stays the same from one pass of a loop to the next
+	and the number of entries is bounded by the script.
+*/
+
+typedef struct Subst_cache_def
+{
+        char*text;
+        Input*tree;
+        struct Subst_cache_def*next;
+} Subst_cache;
+
+#define SUBST_BUCKETS 64
+
+static Subst_cache*subst_cache[SUBST_BUCKETS];
+
+/*
+	Find the parsed form of a command substitution, parsing it on
+	first use.  The parser's state is saved around it and it reads no
+	further input.
+
+	Postcondition: returns nonzero after a syntax error was reported
+*/
+
+static int subst_compile(const char*text,Input**treep)
+{
+        register unsigned int h=2166136261U;
+        register const char*p;
+        Subst_cache*cp;
+        Strbuf saved_src=src;
+        size_t saved_pos=lexpos,saved_heredocs=nheredocs;
+        Token saved_tok=tok;
+        int saved_error=parse_error,saved_nesting=nesting,error;
+        int saved_input=input_fd;
+
+        for(p=text;*p;p++)
+                h=(h^(unsigned char)*p)*16777619U;
+
+        h%=SUBST_BUCKETS;
+
+        for(cp=subst_cache[h];cp;cp=cp->next)
+                if(!strcmp(cp->text,text))
+                {
+                        *treep=cp->tree;
+                        return 0;
                 }
 
-                if(!input_data)
-		{
-                        input_data=parse_inbuf(inbuf);
-			if(!input_data)
-				continue;
-		}
+        memset(&src,0,sizeof src);
+        sb_putn(&src,text,strlen(text));
+        lexpos=0;
+        nesting=0;
+        nheredocs=0;
+        parse_error=0;
+        input_fd=-1;
+
+        lex();
+        *treep=parse_list();
+
+        if(!parse_error&&tok.type!=T_EOF)
+                syntax_error();
+
+        error=parse_error;
+        free(tok.text);
+        free(src.s);
+
+        src=saved_src;
+        lexpos=saved_pos;
+        nheredocs=saved_heredocs;
+        tok=saved_tok;
+        parse_error=saved_error;
+        nesting=saved_nesting;
+        input_fd=saved_input;
+
+        if(error)
+                return 1;
+
+        cp=malloc(sizeof *cp);
+        if(!cp)
+                shfail("malloc");
+
+        cp->text=strdup(text);
+        if(!cp->text)
+                shfail("strdup");
+
+        cp->tree=*treep;
+        cp->next=subst_cache[h];
+        subst_cache[h]=cp;
+
+        return 0;
+}
+
+/*
+	Builtins that do nothing but write to standard output, and so can
+	run in the shell itself with that output captured.
+*/
+
+static int capturable(Builtin f)
+{
+        return f==builtin_echo||f==builtin_printf||f==builtin_true||
+               f==builtin_false||f==builtin_test||f==builtin_help||
+               f==builtin_history||f==builtin_jobs;
+}
+
+static ssize_t capture_write(void*cookie,const char*buf,size_t n)
+{
+        sb_putn((Strbuf*)cookie,buf,n);
+
+        return n;
+}
+
+/*
+	Run a capturable builtin with stdout pointed at a stream that
+	appends to out: no fork and no pipe.
+*/
+
+static int subst_builtin(Input*ip,Strbuf*out)
+{
+        cookie_io_functions_t io={ NULL,capture_write,NULL,NULL };
+        FILE*saved=stdout,*fp;
+        Vec args={0};
+        Strbuf sb={0};
+        register char**pp;
+        int status;
+
+        for(pp=ip->cmdvec;*pp;pp++)
+                expand(*pp,&sb,&args);
+
+        free(sb.s);
+
+        if(expand_error)
+        {
+                vec_free(&args);
+                return 1;
+        }
+
+        fp=fopencookie(out,"w",io);
+        if(!fp)
+                shfail("fopencookie");
+
+        stdout=fp;
+        status=ip->internal(args.v);
+        fclose(fp);
+        stdout=saved;
+
+        vec_free(&args);
+
+        return status;
+}
+
+/*
+	Run a parsed substitution as the rest of a forked child.  A lone
+	program is exec()ed here rather than forked again.  Never returns.
+*/
+
+static void run_subshell(Input*body)
+{
+        size_t i;
+
+        in_child=1;
+
+        /* Pipe ends of other substitutions would hold off their EOF. */
+        for(i=0;i<nprocsubst;i++)
+                close(procsubst[i].fd);
+
+        nprocsubst=0;
+
+        if(body&&!body->link&&body->kind==IN_SIMPLE&&!body->background&&!body->internal)
+        {
+                Vec args={0};
+                Strbuf sb={0};
+                register char**pp;
+
+                for(pp=body->cmdvec;*pp;pp++)
+                        expand(*pp,&sb,&args);
+
+                if(!args.v)
+                        vec_push(&args,NULL);
+
+                if(!expand_error)
+                        run_child(body,args.v);
+
+                _exit(EXIT_FAILURE);
+        }
+
+        run_list(body);
+        fflush(stdout);
+        _exit(last_status);
+}
+
+#define SUBST_PIPE_SIZE (1<<20)
+#define SUBST_READ 65536
+
+/*
+	Run a command substitution in a child and read its output into
+	out.  The pipe is enlarged so a big producer seldom blocks on it.
+*/
+
+static int subst_fork(Input*body,Strbuf*out)
+{
+        int pfd[2];
+        pid_t pid;
+        ssize_t n;
+
+        if(pipe2(pfd,O_CLOEXEC)<0)
+        {
+                shfault("pipe: %s",strerror(errno));
+                return 1;
+        }
+
+        /* Best effort: the size is capped by /proc/sys/fs/pipe-max-size. */
+        fcntl(pfd[0],F_SETPIPE_SZ,SUBST_PIPE_SIZE);
+
+        fflush(stdout);
+
+        pid=fork();
+        if(!pid) /* child */
+        {
+                close(pfd[0]);
+
+                if(pfd[1]!=STDOUT_FILENO)
+                {
+                        dup2(pfd[1],STDOUT_FILENO);
+                        close(pfd[1]);
+                }
+
+                run_subshell(body);
+        }
+
+        /* parent */
+        close(pfd[1]);
+
+        if(pid<0)
+        {
+                shfault("%s",strerror(errno));
+                close(pfd[0]);
+                return 1;
+        }
+
+        for(;;)
+        {
+                sb_grow(out,SUBST_READ);
+
+                n=read(pfd[0],out->s+out->len,out->size-out->len-1);
+
+                if(n>0)
+                        out->len+=n;
+                else if(!n)
+                        break;
+                else if(errno!=EINTR)
+                {
+                        shfault("read: %s",strerror(errno));
+                        break;
+                }
+        }
+
+        close(pfd[0]);
+
+        return wait_fg(pid);
+}
+
+/*
+	Substitute the output of $(command).  Unless the result is to be
+	split into fields or escaped as a pattern, it is read straight
+	into the word being built, and so, for an assignment, into the
+	string putenv() keeps.  Trailing newlines are trimmed from the end
+	inward.
+
+	Precondition: p points at "$("
+	Postcondition: returns the first character after the closing ')'
+*/
+
+static char*expand_command(char*p,Strbuf*sb,Vec*fields,int*have)
+{
+        char*end=bracket_end(p+1),*text;
+        int quoted=expand_quoted;
+        Strbuf out={0},*dest=fields||expand_glob?&out:sb;
+        size_t start=dest->len;
+        Input*body;
+
+        if(!end)
+        {
+                shfault("%s: missing ')'",p);
+                expand_error=1;
+                return p+strlen(p);
+        }
+
+        text=strndup(p+2,end-(p+2));
+        if(!text)
+                shfail("strndup");
+
+        if(subst_compile(text,&body))
+        {
+                free(text);
+                expand_error=1;
+                return end+1;
+        }
+
+        free(text);
+
+        if(!body)
+                subst_status=0;
+        else if(!body->link&&body->kind==IN_SIMPLE&&!body->background&&
+                !body->redirs&&!body->assigns&&capturable(body->internal))
+                subst_status=subst_builtin(body,dest);
+        else
+                subst_status=subst_fork(body,dest);
+
+        while(dest->len>start&&dest->s[dest->len-1]=='\n')
+                dest->len--;
+
+        last_status=subst_status;
+
+        if(dest==&out)
+        {
+                expand_quoted=quoted;
+                put_value(sb,out.s,out.len,fields,have);
+                free(out.s);
+        }
+
+        return end+1;
+}
+
+/*
+	Substitute <(command) or >(command): start the command on one end
+	of a pipe and give its /dev/fd name to the command being expanded,
+	which inherits the other end (see close_stray_fds()).  Both run at
+	once; no file is written.
+
+	Precondition: p points at "<(" or ">("
+	Postcondition: returns the first character after the closing ')'
+*/
+
+static char*expand_procsubst(char*p,Strbuf*sb,Vec*fields,int*have)
+{
+        char*end=bracket_end(p+1),*text,path[32];
+        int pfd[2],out=*p=='<';
+        Input*body;
+        pid_t pid;
+
+        if(!end)
+        {
+                shfault("%s: missing ')'",p);
+                expand_error=1;
+                return p+strlen(p);
+        }
+
+        text=strndup(p+2,end-(p+2));
+        if(!text)
+                shfail("strndup");
+
+        if(subst_compile(text,&body))
+        {
+                free(text);
+                expand_error=1;
+                return end+1;
+        }
+
+        free(text);
+
+        if(pipe2(pfd,O_CLOEXEC)<0)
+        {
+                shfault("pipe: %s",strerror(errno));
+                expand_error=1;
+                return end+1;
+        }
+
+        fflush(stdout);
+
+        pid=fork();
+        if(!pid) /* child */
+        {
+                dup2(pfd[out],out?STDOUT_FILENO:STDIN_FILENO);
+                close(pfd[0]);
+                close(pfd[1]);
+                run_subshell(body);
+        }
+
+        /* parent */
+        close(pfd[out]);
+
+        if(pid<0)
+        {
+                shfault("%s",strerror(errno));
+                close(pfd[!out]);
+                expand_error=1;
+                return end+1;
+        }
+
+        if(nprocsubst==procsubst_size)
+        {
+                procsubst_size=procsubst_size?2*procsubst_size:4;
+                procsubst=realloc(procsubst,procsubst_size*sizeof *procsubst);
+                if(!procsubst)
+                        shfail("realloc");
+        }
+
+        procsubst[nprocsubst].fd=pfd[!out];
+        procsubst[nprocsubst++].pid=pid;
+
+        snprintf(path,sizeof path,"/dev/fd/%d",pfd[!out]);
+        put_value(sb,path,strlen(path),fields,have);
+
+        return end+1;
+}
+
+/*
+	Children of process substitutions whose command went to the
+	background, to be reaped along with the jobs.
+*/
+
+static pid_t*procsubst_strays;
+static size_t nprocsubst_strays,procsubst_strays_size;
 
-                hptr->cmdvec=input_data->cmdvec;
-                hptr->background=input_data->background;
-                hptr->internal=input_data->internal;
+/*
+	Close the shell's ends of the process substitutions made since
+	mark, now that the command using them has them or is done, and
+	wait for their children, or leave them to reap_procsubst().
+*/
+
+static void procsubst_done(size_t mark,int wait)
+{
+        size_t i;
 
-                if(input_data->internal&&!input_data->background)
+        for(i=mark;i<nprocsubst;i++)
+                close(procsubst[i].fd);
+
+        for(i=mark;i<nprocsubst;i++)
+        {
+                if(wait)
                 {
-                        input_data->internal(input_data->historical?input_data->cmdvec[0]:inbuf);
+                        while(waitpid(procsubst[i].pid,NULL,0)<0&&errno==EINTR)
+                                ;
+
                         continue;
                 }
 
-                pid=fork();
-                if(!pid) /* child */
+                if(nprocsubst_strays==procsubst_strays_size)
                 {
-                        if(input_data->internal)
-                                input_data->internal(inbuf);
-			else
-			{
-                        	execvp(input_data->cmdvec[0],input_data->cmdvec);
-				shfault("%s: %s",input_data->cmdvec[0],strerror(errno));
-			}
+                        procsubst_strays_size=procsubst_strays_size?2*procsubst_strays_size:4;
+                        procsubst_strays=realloc(procsubst_strays,procsubst_strays_size*sizeof *procsubst_strays);
+                        if(!procsubst_strays)
+                                shfail("realloc");
+                }
+
+                procsubst_strays[nprocsubst_strays++]=procsubst[i].pid;
+        }
+
+        nprocsubst=mark;
+}
+
+static void reap_procsubst(void)
+{
+        size_t i;
 
-                        exit(EXIT_SUCCESS);
+        for(i=0;i<nprocsubst_strays;)
+                if(waitpid(procsubst_strays[i],NULL,WNOHANG)!=0)
+                        procsubst_strays[i]=procsubst_strays[--nprocsubst_strays];
+                else
+                        i++;
+}
+
+void handler(int signum){}
+
+int main(int argc,char**argv)
+{
+        char*inbuf;
+        Input*input_data,*hptr;
+        unsigned long count_commands=1;
+        register char*p;
+
+        input_fd=STDIN_FILENO;
+
+        if(argc>1)
+        {
+                input_fd=open(argv[1],O_RDONLY|O_CLOEXEC);
+                if(input_fd<0)
+                        shfail(argv[1]);
+        }
+
+        interactive=input_fd==STDIN_FILENO;
+
+        if(interactive)
+                puts(":-) Welcome to supersh. Type help for help.\n");
+
+	signal(SIGINT,SIG_IGN);
+	signal(SIGTERM,SIG_IGN);
+
+        while(1)
+        {
+                if(interactive)
+                        printf("[%lu]%c ",count_commands,getuid()?'$':'#');
+
+                inbuf=malloc(BUFSIZ);
+                if(!inbuf)
+                        shfail("malloc");
+
+                p=inbuf;
+
+                /* Nothing buffered: service jobs until input comes. */
+                if(nwatched&&input_pos==input_len)
+                {
+                        int fd=input_fd;
+
+                        fflush(stdout);
+                        event_wait(&fd,1,-1);
                 }
-                else     /* parent */
+
+                if(!read_line(p,BUFSIZ))
+                        exit(last_status);
+
+                reap_jobs();
+                reap_procsubst();
+
+                p+=strspn(p," \t\r\n\v\f");
+                if(!*p)
                 {
-                        if(pid<0)
-                        {
-				shfault("%s",strerror(errno));
-                                continue;
-                        }
-                        else
-                        {
-                                register unsigned int cnt=0;
-				int stat_loc=0;
+                        free(inbuf);
+                        continue;
+                }
 
-                                if(!input_data->background)
-                                {
-                                        waitpid(pid,&stat_loc,0);
-                                        wait_handler(stat_loc);
-                                        continue;
-                                }
+                count_commands++;
 
-                                for(jptr=joblist;jptr&&jptr->next;jptr=jptr->next)
-					cnt++;
+                input_data=parse_inbuf(inbuf);
+                free(inbuf);
 
-                                if(!jptr)
-                                {
-                                        joblist=malloc(sizeof *joblist);
-                                        jptr=joblist;
-                                }
-                                else
-                                {
-                                        jptr->next=malloc(sizeof *jptr);
-                                        jptr=jptr->next;
-                                }
+		if(!input_data)
+		{
+                        if(parse_error)
+                                last_status=2;
+
+			continue;
+		}
+
+                if(!histlist)
+                        histlist=input_data;
+                else
+                {
+                        register unsigned int cnt=1;
+
+                        for(hptr=histlist;hptr->next;hptr=hptr->next)
+                                cnt++;
 
-                                if(!jptr)
-                                        shfail("malloc");
+                        if(cnt>=BUFSIZ)
+                        {
+                                Input*histp=histlist->next;
 
-                                jptr->pid=pid;
-                                jptr->cmdbuf=inbuf;
-                                printf("Begin\tpid: %d job: %u argv: %s\n",(int)pid,++cnt,inbuf);
+                                free(histlist);
+                                histlist=histp;
                         }
+
+                        hptr->next=input_data;
                 }
+
+                last_status=run_command(input_data);
         }
 
         return 0;